@@ -3,10 +3,64 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
 #include <memory>
 #include <sstream>
 #include <iomanip>
 #include <cctype>
+#include <cerrno>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <system_error>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <new>
+#include <type_traits>
+#include <random>
+#include <chrono>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CLT_X86_KERNELS 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Функции с векторными инструкциями компилируются под свой набор команд, а вызываются,
+// только если процессор его поддерживает (MSVC разрешает такие инструкции и без атрибута)
+#ifdef __GNUC__
+#define CLT_TARGET(features) __attribute__((target(features)))
+#else
+#define CLT_TARGET(features)
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
@@ -21,488 +75,6110 @@ struct Token {
     string value;
     int line;
     int column;
+    // текст, который не копировался: ссылка во внешний буфер лексера
+    const char* span = nullptr;
+    size_t spanSize = 0;
 
     Token(TokenType t, const string& v = "", int l = 0, int c = 0)
         : type(t), value(v), line(l), column(c) {
     }
+
+    string text() const { return span ? string(span, spanSize) : value; }
 };
 
-class ASTNode {
-public:
-    virtual ~ASTNode() = default;
-    virtual string toJSON(int indent = 0) const = 0;
+// Класс байтов для ядер сканирования: бит в таблице для скалярной версии и до четырёх
+// диапазонов [low, high] для векторных. Ядро возвращает длину начальной серии байтов,
+// которые входят (inside) или не входят в класс
+struct ByteClass {
+    unsigned char bit;
+    int ranges;
+    unsigned char low[4];
+    unsigned char high[4];
 };
 
-class NumberNode : public ASTNode {
-    long long value;
-public:
-    NumberNode(long long v) : value(v) {}
-    string toJSON(int indent = 0) const override {
-        return to_string(value);
-    }
-    long long getValue() const { return value; }
+enum ByteClassId { spaceClass, hexClass, identifierClass, stringEndClass, escapeClass };
+
+const ByteClass byteClasses[] = {
+    { 1, 2, { '\t', ' ' }, { '\r', ' ' } },                       // пробельные символы, как isspace()
+    { 2, 3, { '0', 'a', 'A' }, { '9', 'f', 'F' } },                // шестнадцатеричные цифры
+    { 4, 4, { '0', 'a', 'A', '_' }, { '9', 'z', 'Z', '_' } },      // продолжение идентификатора
+    { 8, 2, { '"', 0 }, { '"', 0 } },                             // конец строки в кавычках
+    { 16, 3, { 0, '"', '\\' }, { 0x1F, '"', '\\' } },             // символы, которые экранирует JSON
 };
 
-class StringNode : public ASTNode {
-    string value;
-public:
-    StringNode(const string& v) : value(v) {}
-    string toJSON(int indent = 0) const override {
-        return "\"" + value + "\"";
+struct ByteClassTable {
+    unsigned char bits[256];
+    ByteClassTable() {
+        for (int c = 0; c < 256; ++c) {
+            bits[c] = 0;
+            for (const ByteClass& byteClass : byteClasses) {
+                for (int r = 0; r < byteClass.ranges; ++r) {
+                    if (c >= byteClass.low[r] && c <= byteClass.high[r]) bits[c] |= byteClass.bit;
+                }
+            }
+        }
     }
 };
 
-class BoolNode : public ASTNode {
-    bool value;
-public:
-    BoolNode(bool v) : value(v) {}
-    string toJSON(int indent = 0) const override {
-        return value ? "true" : "false";
+const ByteClassTable byteClassTable;
+
+typedef size_t (*ScanFunction)(const char*, size_t, const ByteClass&, bool);
+
+size_t scanScalar(const char* data, size_t size, const ByteClass& byteClass, bool inside) {
+    size_t i = 0;
+    while (i < size && ((byteClassTable.bits[static_cast<unsigned char>(data[i])] & byteClass.bit) != 0) == inside) ++i;
+    return i;
+}
+
+inline int lowestBit(uint64_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+#ifdef CLT_X86_KERNELS
+// SSE4.2: PCMPESTRI сравнивает 16 байт сразу со всеми диапазонами класса
+CLT_TARGET("sse4.2")
+size_t scanSse42(const char* data, size_t size, const ByteClass& byteClass, bool inside) {
+    alignas(16) unsigned char pairs[16] = {};
+    for (int r = 0; r < byteClass.ranges; ++r) {
+        pairs[2 * r] = byteClass.low[r];
+        pairs[2 * r + 1] = byteClass.high[r];
     }
-};
+    __m128i ranges = _mm_load_si128(reinterpret_cast<const __m128i*>(pairs));
+    int rangeBytes = 2 * byteClass.ranges;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int index = inside
+            ? _mm_cmpestri(ranges, rangeBytes, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY)
+            : _mm_cmpestri(ranges, rangeBytes, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES);
+        if (index < 16) return i + index;
+    }
+    return i + scanScalar(data + i, size - i, byteClass, inside);
+}
 
-class ArrayNode : public ASTNode {
-    vector<shared_ptr<ASTNode>> elements;
-public:
-    void addElement(shared_ptr<ASTNode> element) {
-        elements.push_back(element);
+// AVX2: принадлежность диапазону — беззнаковые min/max и сравнение, 32 байта за шаг
+CLT_TARGET("avx2")
+size_t scanAvx2(const char* data, size_t size, const ByteClass& byteClass, bool inside) {
+    __m256i low[4], high[4];
+    for (int r = 0; r < byteClass.ranges; ++r) {
+        low[r] = _mm256_set1_epi8(static_cast<char>(byteClass.low[r]));
+        high[r] = _mm256_set1_epi8(static_cast<char>(byteClass.high[r]));
     }
-    string toJSON(int indent = 0) const override {
-        string result = "[";
-        for (size_t i = 0; i < elements.size(); ++i) {
-            if (i > 0) result += ", ";
-            result += elements[i]->toJSON();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i member = _mm256_setzero_si256();
+        for (int r = 0; r < byteClass.ranges; ++r) {
+            __m256i aboveLow = _mm256_cmpeq_epi8(_mm256_max_epu8(block, low[r]), block);
+            __m256i belowHigh = _mm256_cmpeq_epi8(_mm256_min_epu8(block, high[r]), block);
+            member = _mm256_or_si256(member, _mm256_and_si256(aboveLow, belowHigh));
         }
-        result += "]";
-        return result;
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(member));
+        if (inside) mask = ~mask;
+        if (mask != 0) return i + lowestBit(mask);
+    }
+    return i + scanScalar(data + i, size - i, byteClass, inside);
+}
+
+// AVX-512BW: сравнения сразу дают битовую маску на 64 байта
+CLT_TARGET("avx512f,avx512bw")
+size_t scanAvx512(const char* data, size_t size, const ByteClass& byteClass, bool inside) {
+    __m512i low[4], high[4];
+    for (int r = 0; r < byteClass.ranges; ++r) {
+        low[r] = _mm512_set1_epi8(static_cast<char>(byteClass.low[r]));
+        high[r] = _mm512_set1_epi8(static_cast<char>(byteClass.high[r]));
+    }
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m512i block = _mm512_loadu_si512(data + i);
+        uint64_t member = 0;
+        for (int r = 0; r < byteClass.ranges; ++r) {
+            member |= _mm512_cmpge_epu8_mask(block, low[r]) & _mm512_cmple_epu8_mask(block, high[r]);
+        }
+        uint64_t mask = inside ? ~member : member;
+        if (mask != 0) return i + lowestBit(mask);
+    }
+    return i + scanScalar(data + i, size - i, byteClass, inside);
+}
+#endif
+
+inline unsigned long long magnitudeOf(long long value) {
+    return value < 0 ? 0ULL - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value);
+}
+
+inline size_t digitCount(unsigned long long value) {
+    size_t count = 1;
+    while (value >= 10) {
+        value /= 10;
+        count++;
     }
+    return count;
+}
+
+// Десятичная запись целого: по одной цифре на деление
+char* formatIntegerScalar(char* out, long long value) {
+    unsigned long long magnitude = magnitudeOf(value);
+    if (value < 0) *out++ = '-';
+    char* end = out + digitCount(magnitude);
+    char* p = end;
+    do {
+        *--p = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    return end;
+}
+
+// То же по две цифры на деление из таблицы "00".."99"
+char* formatIntegerPairs(char* out, long long value) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    unsigned long long magnitude = magnitudeOf(value);
+    if (value < 0) *out++ = '-';
+    char* end = out + digitCount(magnitude);
+    char* p = end;
+    while (magnitude >= 100) {
+        const char* pair = pairs + 2 * (magnitude % 100);
+        magnitude /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (magnitude >= 10) {
+        *--p = pairs[2 * magnitude + 1];
+        *--p = pairs[2 * magnitude];
+    }
+    else {
+        *--p = static_cast<char>('0' + magnitude);
+    }
+    return end;
+}
+
+// Большинство серий (пробел между токенами, короткое число) короче вектора, поэтому первые
+// байты проверяются по таблице, и векторная версия подключается только для длинных серий
+template <ScanFunction Scan, int Class, bool Inside>
+size_t scanKernel(const char* data, size_t size) {
+    const size_t shortRun = 16;
+    size_t head = min(size, shortRun);
+    size_t count = scanScalar(data, head, byteClasses[Class], Inside);
+    if (count < head || head == size) return count;
+    return count + Scan(data + count, size - count, byteClasses[Class], Inside);
+}
+
+// Набор ядер одного уровня. Выбирается один раз при запуске (или флагом --kernels)
+struct TextKernels {
+    const char* level;
+    size_t (*skipSpaces)(const char*, size_t);
+    size_t (*hexDigits)(const char*, size_t);
+    size_t (*identifier)(const char*, size_t);
+    size_t (*stringBody)(const char*, size_t);
+    size_t (*unescaped)(const char*, size_t);
+    char* (*formatInteger)(char*, long long);
 };
 
-class ObjectNode : public ASTNode {
-    map<string, shared_ptr<ASTNode>> properties;
+template <ScanFunction Scan>
+TextKernels kernelsFor(const char* level, char* (*formatInteger)(char*, long long)) {
+    return TextKernels{ level,
+        &scanKernel<Scan, spaceClass, true>, &scanKernel<Scan, hexClass, true>,
+        &scanKernel<Scan, identifierClass, true>, &scanKernel<Scan, stringEndClass, false>,
+        &scanKernel<Scan, escapeClass, false>, formatInteger };
+}
+
+// Поддерживает ли процессор (и ОС — сохранение векторных регистров) уровень ядер
+bool cpuSupports(const string& level) {
+    if (level == "scalar") return true;
+#if defined(CLT_X86_KERNELS) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (level == "sse4.2") return __builtin_cpu_supports("sse4.2");
+    if (level == "avx2") return __builtin_cpu_supports("avx2");
+    if (level == "avx512") return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#elif defined(CLT_X86_KERNELS) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool sse42 = (info[2] & (1 << 20)) != 0;
+    unsigned long long xcr0 = (info[2] & (1 << 27)) ? _xgetbv(0) : 0;
+    __cpuidex(info, 7, 0);
+    if (level == "sse4.2") return sse42;
+    if (level == "avx2") return (info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6;
+    if (level == "avx512") return (info[1] & (1 << 16)) && (info[1] & (1 << 30)) && (xcr0 & 0xE6) == 0xE6;
+#endif
+    return false;
+}
+
+// Уровни от простого к лучшему
+const char* const kernelLevels[] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+TextKernels kernelsAt(const string& level) {
+#ifdef CLT_X86_KERNELS
+    if (level == "sse4.2") return kernelsFor<scanSse42>("sse4.2", formatIntegerPairs);
+    if (level == "avx2") return kernelsFor<scanAvx2>("avx2", formatIntegerPairs);
+    if (level == "avx512") return kernelsFor<scanAvx512>("avx512", formatIntegerPairs);
+#endif
+    return kernelsFor<scanScalar>("scalar", formatIntegerScalar);
+}
+
+TextKernels bestKernels() {
+    string best = "scalar";
+    for (const char* level : kernelLevels) {
+        if (cpuSupports(level)) best = level;
+    }
+    return kernelsAt(best);
+}
+
+TextKernels textKernels = bestKernels();
+
+// Принудительный выбор уровня (для проверки); false, если процессор его не поддерживает
+bool selectKernels(const string& level) {
+    if (!cpuSupports(level)) return false;
+    textKernels = kernelsAt(level);
+    return true;
+}
+
+// Отчёт --cpu-info: доступные уровни и реализация каждого ядра
+void printKernelReport(ostream& out) {
+    out << "Уровни ядер:";
+    for (const char* level : kernelLevels) {
+        out << ' ' << level << (cpuSupports(level) ? "+" : "-");
+    }
+    out << "\nВыбран: " << textKernels.level << "\n";
+    const char* scan = textKernels.level;
+    const char* integers = textKernels.formatInteger == formatIntegerPairs ? "пары цифр" : "по одной цифре";
+    out << "  пропуск пробелов          " << scan << "\n";
+    out << "  шестнадцатеричные числа   " << scan << "\n";
+    out << "  строки в кавычках         " << scan << "\n";
+    out << "  экранирование строк       " << scan << "\n";
+    out << "  идентификаторы            " << scan << "\n";
+    out << "  форматирование целых      " << integers << "\n";
+}
+
+// SHA-256 (FIPS 180-4), считается по мере записи данных
+class Sha256 {
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t blockSize = 0;
+    uint64_t totalBytes = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const unsigned char* data) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(data[4 * i]) << 24) | (uint32_t(data[4 * i + 1]) << 16) |
+                (uint32_t(data[4 * i + 2]) << 8) | uint32_t(data[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
 public:
-    void addProperty(const string& key, shared_ptr<ASTNode> value) {
-        properties[key] = value;
+    Sha256() {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state, initial, sizeof(state));
     }
-    string toJSON(int indent = 0) const override {
-        if (properties.empty()) return "{}";
 
-        string result = "{\n";
-        string indentStr(indent + 2, ' ');
-        bool first = true;
-        for (const auto& prop : properties) {
-            if (!first) result += ",\n";
-            result += indentStr + "\"" + prop.first + "\": " + prop.second->toJSON(indent + 2);
-            first = false;
+    void update(const char* data, size_t size) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        totalBytes += size;
+        if (blockSize > 0) {
+            size_t take = min(size, 64 - blockSize);
+            memcpy(block + blockSize, bytes, take);
+            blockSize += take;
+            bytes += take;
+            size -= take;
+            if (blockSize < 64) return;
+            compress(block);
+            blockSize = 0;
+        }
+        for (; size >= 64; bytes += 64, size -= 64) compress(bytes);
+        memcpy(block, bytes, size);
+        blockSize = size;
+    }
+
+    // Завершает вычисление и возвращает хеш в шестнадцатеричном виде
+    string hexDigest() {
+        uint64_t bits = totalBytes * 8;
+        unsigned char padding[72] = { 0x80 };
+        size_t padSize = (blockSize < 56 ? 56 : 120) - blockSize;
+        for (int i = 0; i < 8; ++i) padding[padSize + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        update(reinterpret_cast<const char*>(padding), padSize + 8);
+        static const char digits[] = "0123456789abcdef";
+        string result;
+        for (uint32_t word : state) {
+            for (int shift = 28; shift >= 0; shift -= 4) result += digits[(word >> shift) & 0xF];
         }
-        result += "\n" + string(indent, ' ') + "}";
         return result;
     }
 };
 
-class Lexer {
-    string input;
-    size_t position;
-    int line;
-    int column;
+// Откуда взята память блока: большие страницы по 2 МБ (MAP_HUGETLB), прозрачные большие
+// страницы (MADV_HUGEPAGE), обычные страницы отображения или куча (operator new)
+enum class PageKind { huge, transparent, regular, heap };
+
+const size_t hugePageSize = 2 * 1024 * 1024;
 
-    char peek() const {
-        return position < input.length() ? input[position] : '\0';
+struct PageBlock {
+    char* data;
+    size_t size;
+    PageKind kind;
+};
+
+// Занятая блоками память по видам страниц: текущая и наибольшая за время работы (для --stats)
+struct PageUsage {
+    atomic<size_t> current[4];
+    atomic<size_t> peak[4];
+
+    PageUsage() {
+        for (int i = 0; i < 4; ++i) {
+            current[i] = 0;
+            peak[i] = 0;
+        }
     }
+    void add(PageKind kind, size_t size) {
+        int i = static_cast<int>(kind);
+        size_t now = current[i] += size;
+        size_t seen = peak[i];
+        while (now > seen && !peak[i].compare_exchange_weak(seen, now)) {}
+    }
+    void remove(PageKind kind, size_t size) {
+        current[static_cast<int>(kind)] -= size;
+    }
+};
 
-    char advance() {
-        char c = peek();
-        if (c != '\0') {
-            position++;
-            if (c == '\n') {
-                line++;
-                column = 1;
-            }
-            else {
-                column++;
+PageUsage pageUsage;
+
+// Блок не меньше size байт. С huge сначала пробуются явные большие страницы, затем
+// отображение, выровненное по 2 МБ, с просьбой к ядру собрать его из прозрачных больших
+// страниц; если отображений нет (Windows) или они не удались — обычная куча
+PageBlock allocatePages(size_t size, bool huge) {
+    PageBlock block = { nullptr, size, PageKind::heap };
+#ifndef _WIN32
+    if (huge) {
+        size_t rounded = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+        void* pages = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        pages = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (pages != MAP_FAILED) block = { static_cast<char*>(pages), rounded, PageKind::huge };
+#endif
+        if (pages == MAP_FAILED) {
+            // запас в одну страницу, чтобы начало блока попало на границу 2 МБ
+            pages = mmap(nullptr, rounded + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (pages != MAP_FAILED) {
+                char* start = static_cast<char*>(pages);
+                char* aligned = reinterpret_cast<char*>(
+                    (reinterpret_cast<uintptr_t>(start) + hugePageSize - 1) & ~(uintptr_t)(hugePageSize - 1));
+                if (aligned > start) munmap(start, aligned - start);
+                size_t tail = start + rounded + hugePageSize - (aligned + rounded);
+                if (tail > 0) munmap(aligned + rounded, tail);
+                block = { aligned, rounded, PageKind::regular };
+#ifdef MADV_HUGEPAGE
+                if (madvise(aligned, rounded, MADV_HUGEPAGE) == 0) block.kind = PageKind::transparent;
+#endif
             }
         }
-        return c;
     }
+#endif
+    if (!block.data) block.data = static_cast<char*>(::operator new(size));
+    pageUsage.add(block.kind, block.size);
+    return block;
+}
 
-    void skipWhitespace() {
-        while (position < input.length() && isspace(peek())) {
-            advance();
-        }
+void releasePages(const PageBlock& block) {
+    if (!block.data) return;
+    pageUsage.remove(block.kind, block.size);
+    if (block.kind == PageKind::heap) ::operator delete(block.data);
+#ifndef _WIN32
+    else munmap(block.data, block.size);
+#endif
+}
+
+// Непрерывный растущий буфер байтов. С hugePages память берётся через allocatePages(..., true),
+// и длинный буфер (например, вход со stdin) лежит на больших страницах
+class PageBuffer {
+    PageBlock block = { nullptr, 0, PageKind::heap };
+    size_t used = 0;
+    bool huge;
+
+    void grow(size_t needed) {
+        PageBlock bigger = allocatePages(max(needed, max(block.size * 2, size_t(4096))), huge);
+        if (used > 0) memcpy(bigger.data, block.data, used);
+        releasePages(block);
+        block = bigger;
     }
 
-    bool isHexDigit(char c) {
-        return isdigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+public:
+    explicit PageBuffer(bool hugePages = false) : huge(hugePages) {}
+    PageBuffer(const PageBuffer&) = delete;
+    PageBuffer& operator=(const PageBuffer&) = delete;
+    ~PageBuffer() { releasePages(block); }
+
+    void reserve(size_t size) {
+        if (size > block.size) grow(size);
     }
+    void append(const char* data, size_t size) {
+        if (size == 0) return;
+        if (used + size > block.size) grow(used + size);
+        memcpy(block.data + used, data, size);
+        used += size;
+    }
+    void push_back(char c) {
+        if (used == block.size) grow(used + 1);
+        block.data[used++] = c;
+    }
+    void clear() { used = 0; }
+
+    const char* data() const { return block.data; }
+    size_t size() const { return used; }
+    bool empty() const { return used == 0; }
+};
 
+// Задание прервано: его отменили или истёк срок
+class ConversionCancelled : public runtime_error {
 public:
-    Lexer(const string& text) : input(text), position(0), line(1), column(1) {}
+    using runtime_error::runtime_error;
+};
 
-    Token nextToken() {
-        skipWhitespace();
+// Вход нарушил ограничение ConversionLimits. Это ошибка задания, а не отмена:
+// пакет считает такое задание ошибочным
+class LimitExceeded : public runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
 
-        if (position >= input.length()) {
-            return Token(TokenType::EOF_TOKEN, "", line, column);
+// Отмена задания: флаг, который выставляет другой поток, и крайний срок. Срок задаёт поток,
+// который выполняет задание (или ставит его в очередь), флаг можно выставить в любой момент.
+// Лексер проверяет отмену раз в cancellationInterval токенов, OutputSink — при каждом сбросе буфера
+class CancellationToken {
+    atomic<bool> cancelled;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+public:
+    CancellationToken() : cancelled(false) {}
+    void cancel() { cancelled = true; }
+    // срок можно только сократить
+    void expireAt(chrono::steady_clock::time_point when) { deadline = min(deadline, when); }
+    bool requested() const {
+        return cancelled || (deadline != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() >= deadline);
+    }
+    void check() const {
+        if (cancelled) throw ConversionCancelled("задание отменено");
+        if (requested()) throw ConversionCancelled("истёк срок задания");
+    }
+};
+
+const unsigned cancellationInterval = 4096;
+
+// Ограничения одного преобразования против неконтролируемых и злонамеренных входов;
+// 0 — без ограничения. Время ограничивается сроком CancellationToken. Глубина по умолчанию
+// ограничена: разбор, вывод и освобождение дерева рекурсивны, и без предела глубокая
+// вложенность переполнила бы стек. Её можно поднять явно (--max-depth)
+struct ConversionLimits {
+    static const size_t defaultDepth = 4096;
+
+    size_t depth = defaultDepth;  // вложенность массивов и объектов
+    size_t nodes = 0;             // узлы, созданные парсером
+    uint64_t outputBytes = 0;     // байты вывода
+
+    void checkOutput(uint64_t bytes) const {
+        if (outputBytes > 0 && bytes > outputBytes) {
+            throw LimitExceeded("превышен размер вывода: больше " + to_string(outputBytes) + " байт");
         }
+    }
+};
+const size_t ConversionLimits::defaultDepth;
 
-        char current = peek();
-        int startLine = line;
-        int startColumn = column;
+// Счётчики процессора для --perf-counters через perf_event_open (только Linux). События собраны
+// в группы, которые ядро ставит на PMU вместе: циклы, инструкции и промахи ветвлений; промахи L1D,
+// LLC и dTLB; программные время задачи и страничные сбои. Счётчики считают только вызывающий поток
+// и идут непрерывно, а этап — разность снимков в start() и finish(). Событие, которое ядро не дало
+// открыть (perf_event_paranoid, виртуальная машина без PMU), просто отсутствует в отчёте
+class PerfCounters {
+public:
+    static const int eventCount = 8;
+    struct Sample {
+        double values[eventCount];
+    };
+    struct Phase {
+        string name;
+        Sample total;
+    };
+    // Показания: значение и сколько времени событие было включено и реально стояло на PMU
+    struct Reading {
+        uint64_t value[eventCount];
+        uint64_t enabled[eventCount];
+        uint64_t running[eventCount];
+    };
+    // Начало этапа: показания и то, что уже отнесено к этапам
+    struct Mark {
+        Reading counters;
+        Sample claimed;
+    };
 
-        if (current == '0' && position + 1 < input.length() &&
-            (input[position + 1] == 'x' || input[position + 1] == 'X')) {
-            advance();
-            advance();
-            string number;
-            while (position < input.length() && isHexDigit(peek())) {
-                number += advance();
-            }
-            return Token(TokenType::NUMBER, number, startLine, startColumn);
+    static const char* eventName(int event) {
+        static const char* const names[eventCount] = {
+            "циклы", "инструкции", "промахи ветвлений", "промахи L1D (чтение)", "промахи LLC (чтение)",
+            "промахи dTLB (чтение)", "время задачи, нс", "страничные сбои" };
+        return names[event];
+    }
+
+private:
+    int descriptors[eventCount];
+    string failure;
+    vector<Phase> phases;
+    Sample claimed = Sample();
+
+#ifdef __linux__
+    static uint64_t cacheMiss(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+    void open(int event, uint32_t type, uint64_t config, int leader) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // при нехватке счётчиков ядро чередует группы; доля времени работы нужна для пересчёта
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int group = leader >= 0 ? descriptors[leader] : -1;
+        descriptors[event] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+        if (descriptors[event] < 0 && failure.empty()) failure = describe(errno);
+    }
+
+    static string describe(int error) {
+        if (error == EACCES || error == EPERM) {
+            ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+            string level;
+            paranoid >> level;
+            return "нет прав (kernel.perf_event_paranoid = " + (level.empty() ? string("?") : level) + ")";
+        }
+        if (error == ENOENT || error == EOPNOTSUPP || error == EINVAL) {
+            return "событие не поддерживается процессором или виртуальной машиной";
         }
+        if (error == ENOSYS) return "ядро собрано без perf_event_open";
+        return strerror(error);
+    }
+#endif
 
-        if (isalpha(current)) {
-            string identifier;
-            while (position < input.length() && (isalnum(peek()) || peek() == '_')) {
-                identifier += advance();
-            }
-            if (identifier == "global") return Token(TokenType::GLOBAL, identifier, startLine, startColumn);
-            if (identifier == "true" || identifier == "false") return Token(TokenType::STRING, identifier, startLine, startColumn);
-            return Token(TokenType::IDENTIFIER, identifier, startLine, startColumn);
+public:
+    PerfCounters() {
+        for (int i = 0; i < eventCount; ++i) descriptors[i] = -1;
+#ifdef __linux__
+        open(0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+        open(1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0);
+        open(2, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0);
+        open(3, PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_L1D), -1);
+        open(4, PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_LL), 3);
+        open(5, PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_DTLB), 3);
+        open(6, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1);
+        open(7, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, 6);
+#else
+        failure = "счётчики процессора поддерживаются только в Linux";
+#endif
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    ~PerfCounters() {
+#ifndef _WIN32
+        for (int i = 0; i < eventCount; ++i) {
+            if (descriptors[i] >= 0) close(descriptors[i]);
         }
+#endif
+    }
 
-        if (current == '"') {
-            advance();
-            string str;
-            while (position < input.length() && peek() != '"' && peek() != '\0') {
-                str += advance();
-            }
-            if (peek() == '"') advance();
-            return Token(TokenType::STRING, str, startLine, startColumn);
+    bool opened(int event) const { return descriptors[event] >= 0; }
+    // причина, по которой не открылось первое недоступное событие
+    const string& error() const { return failure; }
+
+    Reading read() const {
+        Reading reading = Reading();
+#ifdef __linux__
+        for (int i = 0; i < eventCount; ++i) {
+            uint64_t data[3];
+            if (descriptors[i] < 0 || ::read(descriptors[i], data, sizeof(data)) != sizeof(data)) continue;
+            reading.value[i] = data[0];
+            reading.enabled[i] = data[1];
+            reading.running[i] = data[2];
         }
+#endif
+        return reading;
+    }
 
-        // одиночные символы
-        switch (current) {
-        case '{': advance(); return Token(TokenType::LBRACE, "{", startLine, startColumn);
-        case '}': advance(); return Token(TokenType::RBRACE, "}", startLine, startColumn);
-        case '[': advance(); return Token(TokenType::LBRACKET, "[", startLine, startColumn);
-        case ']': advance(); return Token(TokenType::RBRACKET, "]", startLine, startColumn);
-        case '(': advance(); return Token(TokenType::LPAREN, "(", startLine, startColumn);
-        case ')': advance(); return Token(TokenType::RPAREN, ")", startLine, startColumn);
-        case '#': advance(); return Token(TokenType::HASH, "#", startLine, startColumn);
-        case '=': advance(); return Token(TokenType::EQUALS, "=", startLine, startColumn);
-        case '?': advance(); return Token(TokenType::QUESTION, "?", startLine, startColumn);
+    Mark start() const { return { read(), claimed }; }
+    // Относит к этапу name всё, что насчитано с start(), кроме вложенных этапов, закрытых за это время
+    void finish(const string& name, const Mark& mark) {
+        Reading now = read();
+        size_t index = 0;
+        while (index < phases.size() && phases[index].name != name) index++;
+        if (index == phases.size()) phases.push_back({ name, Sample() });
+        for (int i = 0; i < eventCount; ++i) {
+            // прирост пересчитывается на полное время этапа, если группа стояла на PMU не всё время
+            uint64_t running = now.running[i] - mark.counters.running[i];
+            double counted = running == 0 ? 0.0 : (now.value[i] - mark.counters.value[i])
+                * (static_cast<double>(now.enabled[i] - mark.counters.enabled[i]) / running);
+            double own = counted - (claimed.values[i] - mark.claimed.values[i]);
+            phases[index].total.values[i] += own;
+            claimed.values[i] += own;
         }
+    }
+    const vector<Phase>& finished() const { return phases; }
+};
 
-        // неизвестный символ
-        string invalidChar(1, current);
-        advance();
-        return Token(TokenType::INVALID, invalidChar, startLine, startColumn);
+// Счётчики по этапам в пересчёте на байт входа и на токен (токены считает отдельный проход лексера)
+void printPerfCounters(ostream& out, const PerfCounters& perf, size_t bytes, size_t tokens) {
+    out << "Счётчики процессора (основной поток, " << bytes << " байт входа, " << tokens << " токенов):\n";
+    string missing;
+    bool any = false;
+    for (int i = 0; i < PerfCounters::eventCount; ++i) {
+        if (perf.opened(i)) any = true;
+        else missing += (missing.empty() ? "" : ", ") + string(PerfCounters::eventName(i));
+    }
+    if (!missing.empty()) out << "  недоступны: " << missing << " — " << perf.error() << "\n";
+    if (!any) return;
+    for (const auto& phase : perf.finished()) {
+        out << "  " << phase.name << ":\n";
+        const double* values = phase.total.values;
+        for (int i = 0; i < PerfCounters::eventCount; ++i) {
+            if (!perf.opened(i)) continue;
+            out << "    " << PerfCounters::eventName(i) << ": " << fixed << setprecision(0) << values[i]
+                << setprecision(3) << " (" << values[i] / max<size_t>(bytes, 1) << " на байт, "
+                << values[i] / max<size_t>(tokens, 1) << " на токен)\n";
+        }
+        if (perf.opened(0) && perf.opened(1) && values[0] > 0) {
+            out << "    инструкций за цикл: " << setprecision(2) << values[1] / values[0] << "\n";
+        }
     }
+}
+
+// Кусок памяти для записи без склейки: writeRanges() выводит список кусков подряд
+struct ByteRange {
+    const char* data;
+    size_t size;
 };
 
-class Parser {
-    Lexer& lexer;
-    Token currentToken;
-    map<string, shared_ptr<ASTNode>> constants;
+// Закрывает дескриптор файла: под Windows — через CRT (_close), как и открывался
+void closeDescriptor(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
 
-    void eat(TokenType expected) {
-        if (currentToken.type == expected) {
-            currentToken = lexer.nextToken();
+// Выводит куски подряд; на POSIX — одним системным вызовом на пачку (writev)
+void writeRanges(int fd, vector<ByteRange> ranges) {
+#ifdef _WIN32
+    for (const auto& range : ranges) {
+        const char* data = range.data;
+        size_t left = range.size;
+        while (left > 0) {
+            int n = _write(fd, data, static_cast<unsigned int>(min<size_t>(left, INT_MAX)));
+            if (n < 0) throw runtime_error("Ошибка записи выходного файла");
+            data += n;
+            left -= n;
         }
-        else {
-            throw runtime_error("Синтаксическая ошибка в строке " + to_string(currentToken.line) +
-                ", column " + to_string(currentToken.column) +
-                ": expected " + tokenTypeToString(expected) +
-                ", got " + tokenTypeToString(currentToken.type));
+    }
+#else
+    vector<iovec> vectors;
+    for (const auto& range : ranges) {
+        if (range.size > 0) vectors.push_back({ const_cast<char*>(range.data), range.size });
+    }
+    size_t index = 0;
+    while (index < vectors.size()) {
+        int count = static_cast<int>(min<size_t>(vectors.size() - index, IOV_MAX));
+        ssize_t n = writev(fd, &vectors[index], count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error("Ошибка записи выходного файла");
+        }
+        // частичная запись: пропускаем записанное и продолжаем с остатка
+        size_t written = static_cast<size_t>(n);
+        while (index < vectors.size() && written >= vectors[index].iov_len) {
+            written -= vectors[index].iov_len;
+            index++;
+        }
+        if (written > 0) {
+            vectors[index].iov_base = static_cast<char*>(vectors[index].iov_base) + written;
+            vectors[index].iov_len -= written;
         }
     }
+#endif
+}
 
-    string tokenTypeToString(TokenType type) {
-        switch (type) {
-        case TokenType::NUMBER: return "NUMBER";
-        case TokenType::STRING: return "STRING";
-        case TokenType::IDENTIFIER: return "IDENTIFIER";
-        case TokenType::LBRACE: return "LBRACE";
-        case TokenType::RBRACE: return "RBRACE";
-        case TokenType::LBRACKET: return "LBRACKET";
-        case TokenType::RBRACKET: return "RBRACKET";
-        case TokenType::LPAREN: return "LPAREN";
-        case TokenType::RPAREN: return "RPAREN";
-        case TokenType::HASH: return "HASH";
-        case TokenType::EQUALS: return "EQUALS";
-        case TokenType::QUESTION: return "QUESTION";
-        case TokenType::GLOBAL: return "GLOBAL";
-        case TokenType::EOF_TOKEN: return "EOF_TOKEN";
-        case TokenType::INVALID: return "INVALID";
-        default: return "UNKNOWN";
+// Байты вывода в блоках одного размера: рост не переносит уже записанное в новый буфер,
+// а готовые блоки выводятся через writeRanges() без склейки. После clear() блоки
+// используются заново
+class ChunkedBuffer {
+    vector<PageBlock> blocks;
+    size_t current = 0;
+    size_t used = 0;
+    size_t total = 0;
+    size_t blockSize;
+    bool huge;
+
+public:
+    explicit ChunkedBuffer(size_t block = 64 * 1024, bool hugePages = false)
+        : blockSize(max<size_t>(block, 1)), huge(hugePages) {
+    }
+    ChunkedBuffer(const ChunkedBuffer&) = delete;
+    ChunkedBuffer& operator=(const ChunkedBuffer&) = delete;
+    ~ChunkedBuffer() {
+        for (auto& block : blocks) releasePages(block);
+    }
+
+    void write(const char* data, size_t size) {
+        total += size;
+        while (size > 0) {
+            if (used == blockSize) {
+                current++;
+                used = 0;
+            }
+            if (current == blocks.size()) blocks.push_back(allocatePages(blockSize, huge));
+            size_t take = min(size, blockSize - used);
+            memcpy(blocks[current].data + used, data, take);
+            used += take;
+            data += take;
+            size -= take;
         }
     }
+    void put(char c) { write(&c, 1); }
+    void clear() {
+        current = 0;
+        used = 0;
+        total = 0;
+    }
 
-    shared_ptr<ASTNode> parseValue() {
-        if (currentToken.type == TokenType::NUMBER) {
-            long long value = stoll(currentToken.value, nullptr, 16);
-            auto node = make_shared<NumberNode>(value);
-            eat(TokenType::NUMBER);
-            return node;
+    size_t size() const { return total; }
+    bool empty() const { return total == 0; }
+    size_t capacity() const { return blocks.size() * blockSize; }
+    // занятые части блоков по порядку
+    vector<ByteRange> ranges() const {
+        vector<ByteRange> result;
+        for (size_t i = 0; i < blocks.size() && i <= current && total > 0; ++i) {
+            result.push_back({ blocks[i].data, i == current ? used : blockSize });
         }
-        else if (currentToken.type == TokenType::STRING) {
+        return result;
+    }
+};
+
+// Буферизированный вывод: накапливает байты и сбрасывает их в поток порциями,
+// чтобы потребитель на другом конце канала получал данные по мере генерации
+class OutputSink {
+    ostream* out = nullptr;
+    int descriptor = -1;
+    ChunkedBuffer buffer;
+    size_t flushThreshold;
+    Sha256* digest = nullptr;
+    PerfCounters* perf = nullptr;
+    const CancellationToken* cancellation = nullptr;
+    uint64_t byteLimit = UINT64_MAX;
+    uint64_t total = 0;
+
+    void accept(uint64_t size) {
+        total += size;
+        if (total > byteLimit) {
+            ConversionLimits limits;
+            limits.outputBytes = byteLimit;
+            limits.checkOutput(total);
+        }
+    }
+public:
+    // С hugePages на больших страницах лежат только блоки буфера (по 2 МБ), а сброс по-прежнему
+    // происходит каждые threshold байт: потребитель получает первые байты так же быстро
+    OutputSink(ostream& o, size_t threshold = 64 * 1024, bool hugePages = false)
+        : out(&o), buffer(hugePages ? max(threshold, hugePageSize) : threshold, hugePages), flushThreshold(threshold) {
+    }
+    // Вывод прямо в дескриптор: блоки буфера уходят одним writev, минуя буфер потока
+    OutputSink(int fd, size_t threshold = 64 * 1024, bool hugePages = false)
+        : descriptor(fd), buffer(hugePages ? max(threshold, hugePageSize) : threshold, hugePages), flushThreshold(threshold) {
+    }
+    ~OutputSink() {
+        // ошибку записи сообщает явный flush(); из деструктора исключение не выпускается
+        try {
+            flush();
+        }
+        catch (...) {
+        }
+    }
+
+    void write(const char* data, size_t size) {
+        accept(size);
+        buffer.write(data, size);
+        if (buffer.size() >= flushThreshold) flush();
+    }
+    void write(const string& s) { write(s.data(), s.size()); }
+    void put(char c) {
+        accept(1);
+        buffer.put(c);
+        if (buffer.size() >= flushThreshold) flush();
+    }
+    // сколько байт принято с начала
+    uint64_t written() const { return total; }
+    // память блоков буфера
+    size_t bufferBytes() const { return buffer.capacity(); }
+
+    // хеш считается по тем же порциям, которые уходят в поток, без повторного чтения вывода
+    void hashWith(Sha256& hash) { digest = &hash; }
+    // запись в поток или дескриптор учитывается отдельным этапом "запись"
+    void countWritesWith(PerfCounters& counters) { perf = &counters; }
+    // Вывод больше limits.outputBytes прерывается; отмена проверяется перед каждым сбросом буфера
+    void limit(const ConversionLimits& limits, const CancellationToken* token) {
+        if (limits.outputBytes > 0) byteLimit = limits.outputBytes;
+        cancellation = token;
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            if (cancellation) cancellation->check();
+            vector<ByteRange> ranges = buffer.ranges();
+            if (digest) {
+                for (const auto& range : ranges) digest->update(range.data, range.size);
+            }
+            PerfCounters::Mark mark;
+            if (perf) mark = perf->start();
+            if (out) {
+                for (const auto& range : ranges) out->write(range.data, range.size);
+            }
+            if (descriptor >= 0) writeRanges(descriptor, move(ranges));
+            if (perf) perf->finish("запись", mark);
+            buffer.clear();
+        }
+        if (out) out->flush();
+    }
+};
+
+// Заголовок строки MessagePack (тип и длина); buffer должен вмещать 5 байт
+inline size_t msgPackStringHeader(char* buffer, size_t size) {
+    if (size < 32) {
+        buffer[0] = static_cast<char>(0xa0 | size);
+        return 1;
+    }
+    int bytes = size <= 0xFF ? 1 : size <= 0xFFFF ? 2 : 4;
+    buffer[0] = static_cast<char>(bytes == 1 ? 0xd9 : bytes == 2 ? 0xda : 0xdb);
+    for (int i = bytes; i >= 1; --i) {
+        buffer[i] = static_cast<char>(size & 0xFF);
+        size >>= 8;
+    }
+    return bytes + 1;
+}
+
+// Начальный байт CBOR с основным типом и аргументом; buffer должен вмещать 9 байт
+inline size_t cborHead(char* buffer, uint8_t major, uint64_t value) {
+    int bytes;
+    uint8_t info;
+    if (value < 24) { info = static_cast<uint8_t>(value); bytes = 0; }
+    else if (value <= 0xFF) { info = 24; bytes = 1; }
+    else if (value <= 0xFFFF) { info = 25; bytes = 2; }
+    else if (value <= 0xFFFFFFFFULL) { info = 26; bytes = 4; }
+    else { info = 27; bytes = 8; }
+    buffer[0] = static_cast<char>((major << 5) | info);
+    for (int i = bytes; i >= 1; --i) {
+        buffer[i] = static_cast<char>(value & 0xFF);
+        value >>= 8;
+    }
+    return bytes + 1;
+}
+
+// Строка в кавычках с экранированием по RFC 8785. Out — OutputSink или StringOutput
+template <class Out>
+void writeCanonicalString(Out& out, const char* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    out.put('"');
+    size_t runStart = 0;
+    for (size_t i = 0; ; ++i) {
+        // байты без экранирования пропускаются ядром целыми сериями
+        i += textKernels.unescaped(data + i, size - i);
+        if (i >= size) break;
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        out.write(data + runStart, i - runStart);
+        runStart = i + 1;
+        switch (c) {
+        case '"': out.write("\\\"", 2); break;
+        case '\\': out.write("\\\\", 2); break;
+        case '\b': out.write("\\b", 2); break;
+        case '\f': out.write("\\f", 2); break;
+        case '\n': out.write("\\n", 2); break;
+        case '\r': out.write("\\r", 2); break;
+        case '\t': out.write("\\t", 2); break;
+        default: {
+            char escape[6] = { '\\', 'u', '0', '0', digits[c >> 4], digits[c & 0xF] };
+            out.write(escape, 6);
+        }
+        }
+    }
+    out.write(data + runStart, size - runStart);
+    out.put('"');
+}
+
+// Отчёт --memory-report: число объектов и байты по категориям (виды узлов, буферы детей, строки,
+// таблицы). Внутренние узлы map и unordered_map оцениваются по типичной реализации:
+// у дерева цвет и три указателя, у хеш-таблицы указатель на следующий узел и хеш
+class MemoryReport {
+    struct Line {
+        string name;
+        size_t count;
+        size_t bytes;
+    };
+    vector<Line> lines;
+    unordered_set<const void*> visited;
+
+public:
+    static const size_t treeNodeOverhead = 4 * sizeof(void*);
+    static const size_t hashNodeOverhead = 2 * sizeof(void*);
+
+    // Байты текста строки в куче; короткая строка лежит внутри объекта string
+    static size_t heapBytes(const string& text) {
+        static const size_t inlineCapacity = string().capacity();
+        return text.capacity() > inlineCapacity ? text.capacity() + 1 : 0;
+    }
+
+    void add(const char* name, size_t bytes, size_t count = 1) {
+        for (auto& line : lines) {
+            if (line.name == name) {
+                line.bytes += bytes;
+                line.count += count;
+                return;
+            }
+        }
+        lines.push_back({ name, count, bytes });
+    }
+    // false, если объект уже учтён: на узел-константу или строку из пула ссылаются много раз
+    bool firstVisit(const void* object) { return visited.insert(object).second; }
+
+    size_t bytes(const string& name) const {
+        for (const auto& line : lines) if (line.name == name) return line.bytes;
+        return 0;
+    }
+    size_t count(const string& name) const {
+        for (const auto& line : lines) if (line.name == name) return line.count;
+        return 0;
+    }
+    size_t total() const {
+        size_t sum = 0;
+        for (const auto& line : lines) sum += line.bytes;
+        return sum;
+    }
+    const vector<Line>& categories() const { return lines; }
+};
+
+struct StringOutput {
+    string& target;
+    void write(const char* data, size_t size) { target.append(data, size); }
+    void put(char c) { target += c; }
+};
+
+// Ключ объекта, интернированный на всё время работы программы. Вместе с именем хранятся
+// готовые байты ключа для каждого формата вывода, так что вывод ключа — одно копирование
+struct Symbol {
+    string name;
+    string json;        // "\"имя\": "
+    string canonical;   // "\"имя\":" с экранированием RFC 8785
+    string msgpack;
+    string cbor;
+
+    explicit Symbol(const string& key) : name(key) {
+        json = "\"" + name + "\": ";
+        StringOutput canonicalOut{ canonical };
+        writeCanonicalString(canonicalOut, name.data(), name.size());
+        canonical += ':';
+        char header[9];
+        msgpack.assign(header, msgPackStringHeader(header, name.size()));
+        msgpack += name;
+        cbor.assign(header, cborHead(header, 3, name.size()));
+        cbor += name;
+    }
+};
+
+// Повторяющееся строковое значение из пула: как и у Symbol, вывод значения — одно копирование.
+// Байты формата готовятся при первом выводе в нём, так что кодировки форматов, которых нет
+// среди выходов, не строятся. Выходы могут писаться из разных потоков, поэтому call_once
+class InternedString {
+    enum Encoding { jsonBytes, canonicalBytes, msgpackBytes, cborBytes, encodings };
+    mutable once_flag ready[encodings];
+    mutable string bytes[encodings];
+
+    const string& encoded(Encoding kind) const {
+        call_once(ready[kind], [this, kind] {
+            string& out = bytes[kind];
+            char header[9];
+            switch (kind) {
+            case jsonBytes:
+                out = "\"" + value + "\"";
+                break;
+            case canonicalBytes: {
+                StringOutput canonicalOut{ out };
+                writeCanonicalString(canonicalOut, value.data(), value.size());
+                break;
+            }
+            case msgpackBytes:
+                out.assign(header, msgPackStringHeader(header, value.size()));
+                out += value;
+                break;
+            default:
+                out.assign(header, cborHead(header, 3, value.size()));
+                out += value;
+            }
+        });
+        return bytes[kind];
+    }
+
+public:
+    string value;
+
+    InternedString(const char* data, size_t size) : value(data, size) {}
+
+    const string& json() const { return encoded(jsonBytes); }            // "\"значение\""
+    const string& canonical() const { return encoded(canonicalBytes); }  // с экранированием RFC 8785
+    const string& msgpack() const { return encoded(msgpackBytes); }
+    const string& cbor() const { return encoded(cborBytes); }
+
+    // Текст и уже построенные кодировки
+    size_t heapBytes() const {
+        size_t total = MemoryReport::heapBytes(value);
+        for (const auto& encoding : bytes) total += MemoryReport::heapBytes(encoding);
+        return total;
+    }
+};
+
+// Ключи сравниваются по имени, поэтому порядок свойств остаётся алфавитным
+struct SymbolLess {
+    bool operator()(const Symbol* a, const Symbol* b) const {
+        return a != b && a->name < b->name;
+    }
+};
+
+// Таблица ключей: каждое имя хранится один раз, указатели на Symbol не меняются, пока таблица
+// не очищена. shared() — общая таблица процесса для однократного преобразования из командной строки;
+// она живёт до конца программы и защищена блокировкой. Converter и SpillFile держат свои таблицы
+// без блокировки: ключи одного задания пакета не копятся в общей таблице, а потоки пакета
+// не ждут друг друга на каждом ключе
+class SymbolTable {
+    typedef unordered_map<string, unique_ptr<Symbol>> Symbols;
+    Symbols symbols;
+    mutable mutex lock;
+    bool concurrent;
+
+public:
+    explicit SymbolTable(bool shared = false) : concurrent(shared) {}
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    static SymbolTable& shared() {
+        static SymbolTable table(true);
+        return table;
+    }
+
+    const Symbol& intern(const string& name) {
+        unique_lock<mutex> guard(lock, defer_lock);
+        if (concurrent) guard.lock();
+        auto& symbol = symbols[name];
+        if (!symbol) symbol.reset(new Symbol(name));
+        return *symbol;
+    }
+
+    size_t size() const { return symbols.size(); }
+    // Только когда ни одно дерево не ссылается на ключи таблицы
+    void clear() { symbols.clear(); }
+
+    void account(MemoryReport& report) const {
+        unique_lock<mutex> guard(lock, defer_lock);
+        if (concurrent) guard.lock();
+        size_t bytes = symbols.bucket_count() * sizeof(void*);
+        for (const auto& entry : symbols) {
+            const Symbol& symbol = *entry.second;
+            bytes += sizeof(Symbols::value_type) + MemoryReport::hashNodeOverhead + sizeof(Symbol)
+                + MemoryReport::heapBytes(entry.first) + MemoryReport::heapBytes(symbol.name)
+                + MemoryReport::heapBytes(symbol.json) + MemoryReport::heapBytes(symbol.canonical)
+                + MemoryReport::heapBytes(symbol.msgpack) + MemoryReport::heapBytes(symbol.cbor);
+        }
+        report.add("таблица ключей", bytes, symbols.size());
+    }
+};
+
+// Перевод строки с отступом одним копированием: таблица ",\n" + символы заполнения,
+// из которой берётся префикс нужной длины. Шаг отступа и символ (пробел или табуляция)
+// задаются один раз при создании, поэтому настройка формата ничего не стоит при выводе
+class IndentTable {
+    static const size_t maxColumns = 1024;
+    string table;
+    int step;
+
+public:
+    IndentTable(int width = 2, char fill = ' ') : table(",\n"), step(width) {
+        table.append(maxColumns, fill);
+    }
+
+    int width() const { return step; }
+
+    // "\n" (или ",\n", если comma) и columns символов отступа
+    template <class Out>
+    void write(Out& out, size_t columns, bool comma = false) const {
+        size_t take = min(columns, maxColumns);
+        if (comma) out.write(table.data(), take + 2);
+        else out.write(table.data() + 1, take + 1);
+        // отступы глубже таблицы дописываются её же кусками
+        for (columns -= take; columns > 0; columns -= take) {
+            take = min(columns, maxColumns);
+            out.write(table.data() + 2, take);
+        }
+    }
+
+    // Два пробела на уровень, как в toJSON()
+    static const IndentTable& standard() {
+        static const IndentTable table;
+        return table;
+    }
+};
+
+const size_t IndentTable::maxColumns;
+
+// Размер контейнера, который станет известен только в конце (вывод по мере разбора)
+const size_t unknownSize = static_cast<size_t>(-1);
+
+// Получатель событий обхода дерева. Формат вывода определяется реализацией;
+// размер контейнера передаётся заранее, так как двоичные форматы пишут его в заголовок
+class Emitter {
+public:
+    virtual ~Emitter() = default;
+    virtual void beginObject(size_t size) = 0;
+    virtual void key(const Symbol& name) = 0;
+    virtual void endObject() = 0;
+    virtual void beginArray(size_t size) = 0;
+    virtual void endArray() = 0;
+    virtual void number(long long value) = 0;
+    virtual void stringValue(const char* data, size_t size) = 0;
+    // строка из пула; форматы с подготовленным представлением переопределяют этот метод
+    virtual void internedString(const InternedString& value) {
+        stringValue(value.value.data(), value.value.size());
+    }
+    virtual void boolean(bool value) = 0;
+    // сбрасывает накопленный вывод получателю
+    virtual void flush() = 0;
+};
+
+// Потоковый генератор JSON: получает события обхода дерева и сразу пишет их в OutputSink.
+// Форматирование совпадает с toJSON() байт в байт
+class JsonEmitter : public Emitter {
+    struct Frame {
+        bool isArray;
+        int indent;
+        size_t count;
+    };
+    OutputSink& out;
+    const IndentTable& indentation;
+    int baseIndent;
+    vector<Frame> stack;
+
+    void beforeValue() {
+        if (!stack.empty() && stack.back().isArray) {
+            if (stack.back().count++ > 0) out.write(", ", 2);
+        }
+    }
+
+public:
+    // start — отступ внешнего объекта, как у toJSON(indent) для узла внутри дерева
+    JsonEmitter(OutputSink& sink, const IndentTable& indent = IndentTable::standard(), int start = 0)
+        : out(sink), indentation(indent), baseIndent(start) {
+    }
+
+    void beginObject(size_t size = unknownSize) override {
+        beforeValue();
+        // вложенный в объект объект сдвигается на шаг отступа, объект внутри массива начинается с нуля
+        int indent = stack.empty() ? baseIndent
+            : !stack.back().isArray ? stack.back().indent + indentation.width() : 0;
+        stack.push_back({ false, indent, 0 });
+        out.put('{');
+    }
+    void key(const Symbol& name) override {
+        Frame& frame = stack.back();
+        indentation.write(out, frame.indent + indentation.width(), frame.count++ > 0);
+        out.write(name.json);
+    }
+    void endObject() override {
+        Frame frame = stack.back();
+        stack.pop_back();
+        if (frame.count > 0) {
+            indentation.write(out, frame.indent);
+        }
+        out.put('}');
+    }
+    void beginArray(size_t size = unknownSize) override {
+        beforeValue();
+        stack.push_back({ true, 0, 0 });
+        out.put('[');
+    }
+    void endArray() override {
+        stack.pop_back();
+        out.put(']');
+    }
+    void number(long long value) override {
+        beforeValue();
+        char digits[24];
+        out.write(digits, textKernels.formatInteger(digits, value) - digits);
+    }
+    void stringValue(const char* data, size_t size) override {
+        beforeValue();
+        out.put('"');
+        out.write(data, size);
+        out.put('"');
+    }
+    void internedString(const InternedString& value) override {
+        beforeValue();
+        out.write(value.json());
+    }
+    void boolean(bool value) override {
+        beforeValue();
+        if (value) out.write("true", 4);
+        else out.write("false", 5);
+    }
+    void flush() override { out.flush(); }
+};
+
+// MessagePack: числа — целые минимальной ширины, строки — с префиксом длины
+class MsgPackEmitter : public Emitter {
+    OutputSink& out;
+
+    void writeBigEndian(uint64_t value, int bytes) {
+        char buffer[8];
+        for (int i = bytes - 1; i >= 0; --i) {
+            buffer[i] = static_cast<char>(value & 0xFF);
+            value >>= 8;
+        }
+        out.write(buffer, bytes);
+    }
+    void header(uint8_t code, uint64_t value, int bytes) {
+        out.put(static_cast<char>(code));
+        writeBigEndian(value, bytes);
+    }
+    void containerHeader(size_t size, uint8_t fix, uint8_t code16, uint8_t code32) {
+        if (size == unknownSize) {
+            throw runtime_error("MessagePack требует заранее известный размер контейнера");
+        }
+        if (size < 16) out.put(static_cast<char>(fix | size));
+        else if (size <= 0xFFFF) header(code16, size, 2);
+        else header(code32, size, 4);
+    }
+
+public:
+    MsgPackEmitter(OutputSink& sink) : out(sink) {}
+
+    void beginObject(size_t size) override { containerHeader(size, 0x80, 0xde, 0xdf); }
+    void key(const Symbol& name) override { out.write(name.msgpack); }
+    void endObject() override {}
+    void beginArray(size_t size) override { containerHeader(size, 0x90, 0xdc, 0xdd); }
+    void endArray() override {}
+    void number(long long value) override {
+        if (value >= 0) {
+            if (value < 128) out.put(static_cast<char>(value));
+            else if (value <= 0xFF) header(0xcc, value, 1);
+            else if (value <= 0xFFFF) header(0xcd, value, 2);
+            else if (value <= 0xFFFFFFFFLL) header(0xce, value, 4);
+            else header(0xcf, value, 8);
+        }
+        else {
+            if (value >= -32) out.put(static_cast<char>(value));
+            else if (value >= INT8_MIN) header(0xd0, static_cast<uint8_t>(value), 1);
+            else if (value >= INT16_MIN) header(0xd1, static_cast<uint16_t>(value), 2);
+            else if (value >= INT32_MIN) header(0xd2, static_cast<uint32_t>(value), 4);
+            else header(0xd3, static_cast<uint64_t>(value), 8);
+        }
+    }
+    void stringValue(const char* data, size_t size) override {
+        char buffer[5];
+        out.write(buffer, msgPackStringHeader(buffer, size));
+        out.write(data, size);
+    }
+    void internedString(const InternedString& value) override { out.write(value.msgpack()); }
+    void boolean(bool value) override {
+        out.put(static_cast<char>(value ? 0xc3 : 0xc2));
+    }
+    void flush() override { out.flush(); }
+};
+
+// CBOR (RFC 8949). Контейнер неизвестного размера кодируется как неопределённой длины
+class CborEmitter : public Emitter {
+    OutputSink& out;
+    vector<bool> indefinite;
+
+    void head(uint8_t major, uint64_t value) {
+        char buffer[9];
+        out.write(buffer, cborHead(buffer, major, value));
+    }
+    void beginContainer(uint8_t major, size_t size) {
+        indefinite.push_back(size == unknownSize);
+        if (size == unknownSize) out.put(static_cast<char>((major << 5) | 31));
+        else head(major, size);
+    }
+    void endContainer() {
+        if (indefinite.back()) out.put(static_cast<char>(0xff));
+        indefinite.pop_back();
+    }
+
+public:
+    CborEmitter(OutputSink& sink) : out(sink) {}
+
+    void beginObject(size_t size) override { beginContainer(5, size); }
+    void key(const Symbol& name) override { out.write(name.cbor); }
+    void endObject() override { endContainer(); }
+    void beginArray(size_t size) override { beginContainer(4, size); }
+    void endArray() override { endContainer(); }
+    void number(long long value) override {
+        if (value >= 0) head(0, static_cast<uint64_t>(value));
+        else head(1, static_cast<uint64_t>(-1 - value));
+    }
+    void stringValue(const char* data, size_t size) override {
+        head(3, size);
+        out.write(data, size);
+    }
+    void internedString(const InternedString& value) override { out.write(value.cbor()); }
+    void boolean(bool value) override {
+        out.put(static_cast<char>(value ? 0xf5 : 0xf4));
+    }
+    void flush() override { out.flush(); }
+};
+
+// Каноническое представление числа по RFC 8785: как Number.prototype.toString в ECMAScript.
+// Целые за пределами 2^53 сначала округляются до double, затем выводятся кратчайшими цифрами
+string canonicalNumber(long long value) {
+    const long long exact = 1LL << 53;
+    if (value >= -exact && value <= exact) return to_string(value);
+    double d = static_cast<double>(value);
+    char buffer[40];
+    for (int precision = 1; precision <= 17; ++precision) {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, d);
+        if (strtod(buffer, nullptr) == d) break;
+    }
+    // buffer: [-]d.ddddde+XX -> цифры и порядок, затем дополнение нулями до целого
+    string mantissa;
+    const char* p = buffer;
+    bool negative = *p == '-';
+    if (negative) p++;
+    for (; *p && *p != 'e'; ++p) {
+        if (*p != '.') mantissa += *p;
+    }
+    int exponent = atoi(p + 1);
+    string result = negative ? "-" : "";
+    result += mantissa;
+    if (static_cast<int>(mantissa.size()) < exponent + 1) result.append(exponent + 1 - mantissa.size(), '0');
+    return result;
+}
+
+// Канонический JSON (RFC 8785, JCS): без пробелов, ключи по возрастанию (порядок ObjectNode),
+// числа в форме ECMAScript, в строках экранируются только обязательные символы
+class CanonicalJsonEmitter : public Emitter {
+    struct Frame {
+        bool isArray;
+        size_t count;
+    };
+    OutputSink& out;
+    vector<Frame> stack;
+
+    void beforeValue() {
+        if (!stack.empty() && stack.back().isArray && stack.back().count++ > 0) out.put(',');
+    }
+public:
+    CanonicalJsonEmitter(OutputSink& sink) : out(sink) {}
+
+    void beginObject(size_t size) override {
+        beforeValue();
+        out.put('{');
+        stack.push_back({ false, 0 });
+    }
+    void key(const Symbol& name) override {
+        if (stack.back().count++ > 0) out.put(',');
+        out.write(name.canonical);
+    }
+    void endObject() override {
+        stack.pop_back();
+        out.put('}');
+    }
+    void beginArray(size_t size) override {
+        beforeValue();
+        out.put('[');
+        stack.push_back({ true, 0 });
+    }
+    void endArray() override {
+        stack.pop_back();
+        out.put(']');
+    }
+    void number(long long value) override {
+        beforeValue();
+        out.write(canonicalNumber(value));
+    }
+    void stringValue(const char* data, size_t size) override {
+        beforeValue();
+        writeCanonicalString(out, data, size);
+    }
+    void internedString(const InternedString& value) override {
+        beforeValue();
+        out.write(value.canonical());
+    }
+    void boolean(bool value) override {
+        beforeValue();
+        if (value) out.write("true", 4);
+        else out.write("false", 5);
+    }
+    void flush() override { out.flush(); }
+};
+
+// Раздаёт каждое событие нескольким получателям: один обход дерева — несколько форматов,
+// каждый дополнительный выход стоит только своего кодирования
+class TeeEmitter : public Emitter {
+    vector<Emitter*> targets;
+public:
+    void add(Emitter& target) { targets.push_back(&target); }
+
+    void beginObject(size_t size) override { for (auto t : targets) t->beginObject(size); }
+    void key(const Symbol& name) override { for (auto t : targets) t->key(name); }
+    void endObject() override { for (auto t : targets) t->endObject(); }
+    void beginArray(size_t size) override { for (auto t : targets) t->beginArray(size); }
+    void endArray() override { for (auto t : targets) t->endArray(); }
+    void number(long long value) override { for (auto t : targets) t->number(value); }
+    void stringValue(const char* data, size_t size) override { for (auto t : targets) t->stringValue(data, size); }
+    void internedString(const InternedString& value) override { for (auto t : targets) t->internedString(value); }
+    void boolean(bool value) override { for (auto t : targets) t->boolean(value); }
+    void flush() override { for (auto t : targets) t->flush(); }
+};
+
+unique_ptr<Emitter> makeEmitter(const string& format, OutputSink& sink,
+    const IndentTable& indentation = IndentTable::standard()) {
+    if (format == "json") return unique_ptr<Emitter>(new JsonEmitter(sink, indentation));
+    if (format == "msgpack") return unique_ptr<Emitter>(new MsgPackEmitter(sink));
+    if (format == "cbor") return unique_ptr<Emitter>(new CborEmitter(sink));
+    if (format == "canonical") return unique_ptr<Emitter>(new CanonicalJsonEmitter(sink));
+    throw runtime_error("Неизвестный формат вывода: " + format);
+}
+
+// Точный размер JSON-представления узла: base + lines * indent, где lines — число строк,
+// отступ которых зависит от отступа самого узла. Так размер не зависит от места узла в дереве
+// и его можно запомнить в узле один раз, даже если узел (константа) используется несколько раз
+struct JsonSize {
+    size_t base;
+    size_t lines;
+    size_t at(int indent) const { return base + lines * indent; }
+};
+
+inline size_t integerLength(long long value) {
+    return (value < 0 ? 1 : 0) + digitCount(magnitudeOf(value));
+}
+
+inline char* writeInteger(char* out, long long value) {
+    return textKernels.formatInteger(out, value);
+}
+
+inline char* writeBytes(char* out, const char* data, size_t size) {
+    memcpy(out, data, size);
+    return out + size;
+}
+
+// Память под узлы одного разбора: выделение — сдвиг указателя в текущем блоке, освобождение —
+// сброс всей арены сразу. После reset() блоки используются заново, поэтому повторный разбор
+// похожего текста не обращается к куче. Объекты в арене должны быть уничтожены до reset().
+// С hugePages блоки по 2 МБ берутся на больших страницах (см. allocatePages)
+class NodeArena {
+    vector<PageBlock> blocks;
+    size_t current = 0;
+    size_t used = 0;
+    size_t blockSize;
+    bool huge;
+
+public:
+    explicit NodeArena(size_t block = 64 * 1024, bool hugePages = false)
+        : blockSize(hugePages ? max(block, hugePageSize) : block), huge(hugePages) {
+    }
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+    ~NodeArena() {
+        for (auto& block : blocks) releasePages(block);
+    }
+
+    void* allocate(size_t size, size_t align) {
+        while (true) {
+            if (current < blocks.size()) {
+                size_t offset = (used + align - 1) & ~(align - 1);
+                if (offset + size <= blocks[current].size) {
+                    used = offset + size;
+                    return blocks[current].data + offset;
+                }
+                if (current + 1 < blocks.size()) {
+                    ++current;
+                    used = 0;
+                    continue;
+                }
+            }
+            blocks.push_back(allocatePages(max(blockSize, size + align), huge));
+            current = blocks.size() - 1;
+            used = 0;
+        }
+    }
+
+    void reset() {
+        current = 0;
+        used = 0;
+    }
+
+    // сколько байт арена держит в блоках
+    size_t capacity() const {
+        size_t total = 0;
+        for (auto& block : blocks) total += block.size;
+        return total;
+    }
+};
+
+// Вектор, первые N элементов которого лежат прямо в объекте: маленькие массивы и объекты
+// (а таких большинство) не выделяют отдельный буфер. При переполнении элементы переносятся
+// в кучу или, если задана арена, в неё
+template <class T, size_t N>
+class SmallVector {
+    typename aligned_storage<sizeof(T) * N, alignof(T)>::type inlineStorage;
+    T* first;
+    size_t count = 0;
+    size_t allocated = N;
+    NodeArena* arena = nullptr;
+
+    T* inlineData() { return reinterpret_cast<T*>(&inlineStorage); }
+
+    void grow(size_t newCapacity) {
+        T* data = static_cast<T*>(arena
+            ? arena->allocate(newCapacity * sizeof(T), alignof(T))
+            : ::operator new(newCapacity * sizeof(T)));
+        for (size_t i = 0; i < count; ++i) {
+            new (data + i) T(move(first[i]));
+            first[i].~T();
+        }
+        release();
+        first = data;
+        allocated = newCapacity;
+    }
+
+    void release() {
+        if (first != inlineData() && !arena) ::operator delete(first);
+    }
+
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    SmallVector() : first(inlineData()) {}
+    SmallVector(const SmallVector&) = delete;
+    SmallVector& operator=(const SmallVector&) = delete;
+    ~SmallVector() {
+        truncate(0);
+        release();
+    }
+
+    // Буфер сверх встроенных элементов будет браться из арены; вызывать до первого переполнения
+    void useArena(NodeArena* memory) {
+        if (isInline()) arena = memory;
+    }
+
+    void reserve(size_t size) {
+        if (size > allocated) grow(size);
+    }
+    void push_back(T value) {
+        if (count == allocated) grow(allocated * 2);
+        new (first + count) T(move(value));
+        ++count;
+    }
+    void insert(size_t index, T value) {
+        push_back(move(value));
+        rotate(first + index, first + count - 1, first + count);
+    }
+    // удаляет элементы с индексами от size до конца
+    void truncate(size_t size) {
+        while (count > size) first[--count].~T();
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t capacity() const { return allocated; }
+    bool isInline() const { return allocated == N; }
+    // байты буфера вне объекта (в куче или арене)
+    size_t heapBytes() const { return isInline() ? 0 : allocated * sizeof(T); }
+    T& operator[](size_t i) { return first[i]; }
+    const T& operator[](size_t i) const { return first[i]; }
+    T& back() { return first[count - 1]; }
+    const T& back() const { return first[count - 1]; }
+    iterator begin() { return first; }
+    iterator end() { return first + count; }
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return first + count; }
+};
+
+// Вектор для больших массивов: первые 2^BlockShift элементов лежат в SmallVector (встроенные N,
+// затем буфер, растущий удвоением), остальные — блоками по 2^BlockShift элементов, которые после
+// выделения не перемещаются. Рост массива из миллионов элементов не копирует уже добавленные
+// и не требует на время копирования вдвое больше памяти; перевыделяется только каталог блоков
+template <class T, size_t N, size_t BlockShift = 10>
+class ChunkedVector {
+    static const size_t blockElements = size_t(1) << BlockShift;
+    static const size_t blockMask = blockElements - 1;
+
+    SmallVector<T, N> head;
+    T** blocks = nullptr;
+    size_t blockCount = 0;
+    size_t directorySize = 0;
+    size_t tailCount = 0;
+    NodeArena* arena = nullptr;
+
+    void* allocate(size_t bytes, size_t align) {
+        return arena ? arena->allocate(bytes, align) : ::operator new(bytes);
+    }
+    void release(void* memory) {
+        if (!arena) ::operator delete(memory);
+    }
+    void growDirectory(size_t size) {
+        T** bigger = static_cast<T**>(allocate(size * sizeof(T*), alignof(T*)));
+        if (blockCount > 0) memcpy(bigger, blocks, blockCount * sizeof(T*));
+        release(blocks);
+        blocks = bigger;
+        directorySize = size;
+    }
+    T& tail(size_t index) const {
+        return blocks[index >> BlockShift][index & blockMask];
+    }
+
+public:
+    typedef T value_type;
+
+    // Обход по непрерывным участкам: голова, затем блоки по порядку
+    class const_iterator {
+        const ChunkedVector* owner;
+        size_t run;
+        const T* position;
+        const T* runEnd;
+
+        void enter() {
+            // голова пуста только у пустого вектора
+            if (run == 0 && !owner->head.empty()) {
+                position = owner->head.begin();
+                runEnd = owner->head.end();
+                return;
+            }
+            size_t begin = run == 0 ? 0 : (run - 1) << BlockShift;
+            if (run > 0 && begin < owner->tailCount) {
+                position = owner->blocks[run - 1];
+                runEnd = position + min(blockElements, owner->tailCount - begin);
+                return;
+            }
+            position = nullptr;
+            runEnd = nullptr;
+        }
+
+    public:
+        const_iterator(const ChunkedVector* vector, bool atEnd)
+            : owner(vector), run(0), position(nullptr), runEnd(nullptr) {
+            if (!atEnd) enter();
+        }
+        const T& operator*() const { return *position; }
+        const T* operator->() const { return position; }
+        const_iterator& operator++() {
+            if (++position == runEnd) {
+                run++;
+                enter();
+            }
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const { return position == other.position; }
+        bool operator!=(const const_iterator& other) const { return position != other.position; }
+    };
+    typedef const_iterator iterator;
+
+    ChunkedVector() = default;
+    ChunkedVector(const ChunkedVector&) = delete;
+    ChunkedVector& operator=(const ChunkedVector&) = delete;
+    ~ChunkedVector() {
+        for (size_t i = tailCount; i > 0; --i) tail(i - 1).~T();
+        for (size_t i = 0; i < blockCount; ++i) release(blocks[i]);
+        release(blocks);
+    }
+
+    void useArena(NodeArena* memory) {
+        if (head.isInline() && blockCount == 0) {
+            head.useArena(memory);
+            arena = memory;
+        }
+    }
+    // Голова получает точную ёмкость, а каталог — место под все блоки; сами блоки выделяются по мере заполнения
+    void reserve(size_t size) {
+        head.reserve(min(size, blockElements));
+        if (size > blockElements) {
+            size_t needed = (size - blockElements + blockMask) >> BlockShift;
+            if (needed > directorySize) growDirectory(needed);
+        }
+    }
+    void push_back(T value) {
+        if (head.size() < blockElements) {
+            head.push_back(move(value));
+            return;
+        }
+        if (tailCount == blockCount << BlockShift) {
+            if (blockCount == directorySize) growDirectory(max<size_t>(4, directorySize * 2));
+            blocks[blockCount++] = static_cast<T*>(allocate(blockElements * sizeof(T), alignof(T)));
+        }
+        new (&tail(tailCount)) T(move(value));
+        tailCount++;
+    }
+
+    size_t size() const { return head.size() + tailCount; }
+    bool empty() const { return head.empty(); }
+    size_t capacity() const { return head.capacity() + blockCount * blockElements; }
+    bool isInline() const { return head.isInline() && blockCount == 0; }
+    // число блоков за пределами головы
+    size_t blocksUsed() const { return blockCount; }
+    size_t heapBytes() const {
+        return head.heapBytes() + blockCount * blockElements * sizeof(T) + directorySize * sizeof(T*);
+    }
+    const T& operator[](size_t i) const {
+        return i < blockElements ? head[i] : tail(i - blockElements);
+    }
+    const_iterator begin() const { return const_iterator(this, false); }
+    const_iterator end() const { return const_iterator(this, true); }
+};
+
+template <class T, size_t N, size_t BlockShift>
+const size_t ChunkedVector<T, N, BlockShift>::blockElements;
+
+// Сколько дочерних узлов массив или объект хранит без отдельного выделения памяти
+const size_t inlineChildren = 8;
+
+template <class T> class NodeRef;
+
+class ASTNode {
+    // число NodeRef на узел; меняется только потоком, который строит дерево.
+    // Старший бит отмечает узел из NodeArena: такой узел только уничтожается, без delete
+    mutable size_t references = 0;
+    static const size_t inArena = size_t(1) << (sizeof(size_t) * 8 - 1);
+    template <class T> friend class NodeRef;
+    template <class T, class... Args> friend NodeRef<T> makeNode(NodeArena*, Args&&...);
+public:
+    ASTNode() = default;
+    ASTNode(const ASTNode&) = delete;
+    ASTNode& operator=(const ASTNode&) = delete;
+    virtual ~ASTNode() = default;
+    virtual string toJSON(int indent = 0) const = 0;
+    virtual void emit(Emitter& emitter) const = 0;
+    virtual JsonSize jsonSize() const = 0;
+    // Пишет те же байты, что и toJSON(indent), прямо в out (там должно быть jsonSize().at(indent) байт)
+    virtual char* writeJSON(char* out, int indent = 0) const = 0;
+    // Добавляет в отчёт память узла и его детей
+    virtual void account(MemoryReport& report) const = 0;
+};
+
+// Владеющая ссылка на узел. Счётчик хранится в самом узле и не атомарный: копирование
+// ссылки — обычный инкремент без отдельного блока управления. Поэтому ссылки на узлы одного
+// дерева копируются и уничтожаются только в одном потоке; другим потокам дерево передаётся
+// через FrozenTree или как const ASTNode&, без копирования ссылок
+template <class T>
+class NodeRef {
+    T* node;
+    template <class U> friend class NodeRef;
+
+    void retain() const {
+        if (node) ++node->references;
+    }
+
+public:
+    NodeRef() : node(nullptr) {}
+    NodeRef(nullptr_t) : node(nullptr) {}
+    explicit NodeRef(T* owned) : node(owned) { retain(); }
+    NodeRef(const NodeRef& other) : node(other.node) { retain(); }
+    NodeRef(NodeRef&& other) : node(other.node) { other.node = nullptr; }
+    template <class U>
+    NodeRef(const NodeRef<U>& other) : node(other.node) { retain(); }
+    template <class U>
+    NodeRef(NodeRef<U>&& other) : node(other.node) { other.node = nullptr; }
+    ~NodeRef() { reset(); }
+
+    NodeRef& operator=(NodeRef other) {
+        swap(node, other.node);
+        return *this;
+    }
+    void reset() {
+        if (node) {
+            size_t left = --node->references;
+            if (left == 0) delete node;
+            else if (left == ASTNode::inArena) node->~T();
+        }
+        node = nullptr;
+    }
+
+    T* get() const { return node; }
+    T& operator*() const { return *node; }
+    T* operator->() const { return node; }
+    explicit operator bool() const { return node != nullptr; }
+    size_t useCount() const { return node ? node->references & ~ASTNode::inArena : 0; }
+};
+
+template <class T, class... Args>
+NodeRef<T> makeNode(Args&&... args) {
+    return NodeRef<T>(new T(forward<Args>(args)...));
+}
+
+// Узел в арене (или в куче, если арены нет). Память узла вернётся при сбросе арены
+template <class T, class... Args>
+NodeRef<T> makeNode(NodeArena* arena, Args&&... args) {
+    if (!arena) return makeNode<T>(forward<Args>(args)...);
+    T* node = new (arena->allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+    node->references = ASTNode::inArena;
+    return NodeRef<T>(node);
+}
+
+template <class T>
+NodeRef<T> nodeCast(const NodeRef<ASTNode>& ref) {
+    return NodeRef<T>(dynamic_cast<T*>(ref.get()));
+}
+
+// Узел, на который ссылаются несколько раз, учитывается при первой встрече
+inline void accountNode(MemoryReport& report, const NodeRef<ASTNode>& node) {
+    if (node && (node.useCount() == 1 || report.firstVisit(node.get()))) node->account(report);
+}
+
+// Таблица констант: узлы map с именами и значения, ещё не учтённые в дереве
+inline void accountConstants(MemoryReport& report, const map<string, NodeRef<ASTNode>>& constants) {
+    size_t bytes = 0;
+    for (const auto& constant : constants) {
+        bytes += sizeof(constant) + MemoryReport::treeNodeOverhead + MemoryReport::heapBytes(constant.first);
+        accountNode(report, constant.second);
+    }
+    report.add("таблицы констант (узлы map)", bytes, constants.size());
+}
+
+// Поле из /proc/self/status в байтах (0, если его нет, например вне Linux)
+size_t processStatusBytes(const char* field) {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, strlen(field), field) == 0) {
+            return strtoull(line.c_str() + strlen(field), nullptr, 10) * 1024;
+        }
+    }
+    return 0;
+}
+
+void printMemoryReport(ostream& out, const MemoryReport& report, const NodeArena* arena) {
+    out << "Память:\n";
+    for (const auto& line : report.categories()) {
+        out << "  " << line.name << ": " << line.count << " шт., " << line.bytes << " байт\n";
+    }
+    out << "  всего: " << report.total() << " байт\n";
+    out << "  блоки управления: нет, счётчик ссылок хранится в самом узле\n";
+    if (arena) out << "  узлы и буферы детей размещены в арене, её блоки: " << arena->capacity() << " байт\n";
+    size_t peak = processStatusBytes("VmHWM:");
+    if (peak > 0) out << "  пиковый RSS процесса: " << peak << " байт\n";
+    else out << "  пиковый RSS процесса: недоступно\n";
+}
+
+class NumberNode : public ASTNode {
+    long long value;
+public:
+    NumberNode(long long v) : value(v) {}
+    string toJSON(int indent = 0) const override {
+        return to_string(value);
+    }
+    void emit(Emitter& emitter) const override {
+        emitter.number(value);
+    }
+    JsonSize jsonSize() const override {
+        return { integerLength(value), 0 };
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        return writeInteger(out, value);
+    }
+    void account(MemoryReport& report) const override {
+        report.add("NumberNode", sizeof(*this));
+    }
+    long long getValue() const { return value; }
+};
+
+// Строка либо хранит свою копию, либо ссылается на участок входного буфера (отображённого
+// файла), который живёт дольше дерева. Экранирование, если оно нужно формату, — только при выводе
+class StringNode : public ASTNode {
+    string owned;
+    const char* data;
+    size_t length;
+public:
+    StringNode(const string& v) : owned(v), data(owned.data()), length(owned.size()) {}
+    StringNode(const char* text, size_t size) : data(text), length(size) {}
+    StringNode(const StringNode&) = delete;
+    StringNode& operator=(const StringNode&) = delete;
+
+    string toJSON(int indent = 0) const override {
+        string result;
+        result.reserve(length + 2);
+        result += '"';
+        result.append(data, length);
+        result += '"';
+        return result;
+    }
+    void emit(Emitter& emitter) const override {
+        emitter.stringValue(data, length);
+    }
+    JsonSize jsonSize() const override {
+        return { length + 2, 0 };
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        *out++ = '"';
+        out = writeBytes(out, data, length);
+        *out++ = '"';
+        return out;
+    }
+    void account(MemoryReport& report) const override {
+        report.add("StringNode", sizeof(*this));
+        if (data == owned.data()) report.add("строки: собственные копии", MemoryReport::heapBytes(owned));
+        else report.add("строки: ссылки на входной текст", 0);
+    }
+};
+
+// Значение из пула строк. Один узел разделяется всеми вхождениями строки в дереве
+class InternedStringNode : public ASTNode {
+    InternedString value;
+public:
+    InternedStringNode(const char* data, size_t size) : value(data, size) {}
+    const InternedString& getValue() const { return value; }
+    string toJSON(int indent = 0) const override {
+        return value.json();
+    }
+    void emit(Emitter& emitter) const override {
+        emitter.internedString(value);
+    }
+    JsonSize jsonSize() const override {
+        return { value.json().size(), 0 };
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        return writeBytes(out, value.json().data(), value.json().size());
+    }
+    void account(MemoryReport& report) const override {
+        report.add("InternedStringNode", sizeof(*this));
+        report.add("строки: пул (текст и готовые кодировки)", value.heapBytes());
+    }
+};
+
+// Пул строковых значений одного разбора: одинаковые строки становятся одним узлом.
+// Поиск идёт по байтам без создания временной строки; ключ ссылается на текст внутри узла
+class StringPool {
+    struct View {
+        const char* data;
+        size_t size;
+        bool operator==(const View& other) const {
+            return size == other.size && memcmp(data, other.data, size) == 0;
+        }
+    };
+    struct ViewHash {
+        size_t operator()(const View& view) const {
+            // FNV-1a
+            uint64_t hash = 14695981039346656037ULL;
+            for (size_t i = 0; i < view.size; ++i) {
+                hash = (hash ^ static_cast<unsigned char>(view.data[i])) * 1099511628211ULL;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+    unordered_map<View, NodeRef<InternedStringNode>, ViewHash> nodes;
+    size_t lookups = 0;
+
+public:
+    NodeRef<ASTNode> intern(const char* data, size_t size) {
+        lookups++;
+        auto found = nodes.find(View{ data, size });
+        if (found != nodes.end()) return found->second;
+        auto node = makeNode<InternedStringNode>(data, size);
+        // ключ указывает на копию строки в узле, а не на входной буфер
+        nodes.emplace(View{ node->getValue().value.data(), size }, node);
+        return node;
+    }
+
+    // число различных строк и число обращений к пулу
+    size_t size() const { return nodes.size(); }
+    size_t requests() const { return lookups; }
+
+    // Хеш-таблица пула; сами узлы строк учитываются в дереве
+    void account(MemoryReport& report) const {
+        size_t bytes = nodes.bucket_count() * sizeof(void*)
+            + nodes.size() * (sizeof(decltype(nodes)::value_type) + MemoryReport::hashNodeOverhead);
+        report.add("пул строк (хеш-таблица)", bytes, nodes.size());
+    }
+};
+
+// Константа внутри повторно разобранного элемента потокового массива. Узел константы
+// не захватывается: он принадлежит StreamedArrayNode и живёт дольше элемента, а его счётчик
+// не меняется, так что повторный разбор можно выполнять в любом потоке
+class BorrowedNode : public ASTNode {
+    const ASTNode& target;
+public:
+    BorrowedNode(const ASTNode& node) : target(node) {}
+    string toJSON(int indent = 0) const override {
+        return target.toJSON(indent);
+    }
+    void emit(Emitter& emitter) const override {
+        target.emit(emitter);
+    }
+    JsonSize jsonSize() const override {
+        return target.jsonSize();
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        return target.writeJSON(out, indent);
+    }
+    void account(MemoryReport& report) const override {
+        report.add("BorrowedNode", sizeof(*this));
+    }
+};
+
+class BoolNode : public ASTNode {
+    bool value;
+public:
+    BoolNode(bool v) : value(v) {}
+    string toJSON(int indent = 0) const override {
+        return value ? "true" : "false";
+    }
+    void emit(Emitter& emitter) const override {
+        emitter.boolean(value);
+    }
+    JsonSize jsonSize() const override {
+        return { value ? size_t(4) : size_t(5), 0 };
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        return value ? writeBytes(out, "true", 4) : writeBytes(out, "false", 5);
+    }
+    void account(MemoryReport& report) const override {
+        report.add("BoolNode", sizeof(*this));
+    }
+};
+
+class ArrayNode : public ASTNode {
+public:
+    typedef ChunkedVector<NodeRef<ASTNode>, inlineChildren> Elements;
+private:
+    Elements elements;
+    mutable JsonSize cachedSize;
+    mutable bool sizeKnown = false;
+public:
+    void addElement(NodeRef<ASTNode> element) {
+        elements.push_back(move(element));
+    }
+    void reserve(size_t count) { elements.reserve(count); }
+    void useArena(NodeArena* arena) { elements.useArena(arena); }
+    const Elements& getElements() const { return elements; }
+    string toJSON(int indent = 0) const override {
+        string result = "[";
+        bool first = true;
+        for (const auto& element : elements) {
+            if (!first) result += ", ";
+            result += element->toJSON();
+            first = false;
+        }
+        result += "]";
+        return result;
+    }
+    void emit(Emitter& emitter) const override {
+        emitter.beginArray(elements.size());
+        for (const auto& element : elements) {
+            element->emit(emitter);
+        }
+        emitter.endArray();
+    }
+    JsonSize jsonSize() const override {
+        if (!sizeKnown) {
+            // элементы массива всегда выводятся с нулевым отступом
+            size_t base = elements.empty() ? 2 : 2 * elements.size();
+            for (const auto& element : elements) {
+                base += element->jsonSize().base;
+            }
+            cachedSize = { base, 0 };
+            sizeKnown = true;
+        }
+        return cachedSize;
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        *out++ = '[';
+        bool first = true;
+        for (const auto& element : elements) {
+            if (!first) out = writeBytes(out, ", ", 2);
+            out = element->writeJSON(out);
+            first = false;
+        }
+        *out++ = ']';
+        return out;
+    }
+    void account(MemoryReport& report) const override {
+        report.add("ArrayNode", sizeof(*this));
+        report.add("буферы элементов массивов", elements.heapBytes(), elements.isInline() ? 0 : 1);
+        for (const auto& element : elements) accountNode(report, element);
+    }
+};
+
+// Массив, элементы которого не хранятся в дереве: при выводе они заново разбираются
+// из исходного текста по одному, поэтому память ограничена одним элементом, а не размером массива
+class StreamedArrayNode : public ASTNode {
+    const char* text;
+    size_t length;
+    size_t start;
+    int line;
+    int column;
+    map<string, NodeRef<ASTNode>> constants;
+    size_t count;
+    mutable JsonSize cachedSize;
+    mutable bool sizeKnown = false;
+public:
+    StreamedArrayNode(const char* t, size_t len, size_t s, int l, int c,
+        const map<string, NodeRef<ASTNode>>& consts, size_t n)
+        : text(t), length(len), start(s), line(l), column(c), constants(consts), count(n) {
+    }
+    size_t size() const { return count; }
+    string toJSON(int indent = 0) const override;
+    void emit(Emitter& emitter) const override;
+    JsonSize jsonSize() const override;
+    char* writeJSON(char* out, int indent = 0) const override;
+    void account(MemoryReport& report) const override {
+        report.add("StreamedArrayNode", sizeof(*this));
+        accountConstants(report, constants);
+    }
+};
+
+// Выполняет body(0..count-1) на нескольких потоках; индексы раздаются по одному
+inline void parallelFor(size_t count, unsigned threads, const function<void(size_t)>& body) {
+    if (threads <= 1 || count <= 1) {
+        for (size_t i = 0; i < count; ++i) body(i);
+        return;
+    }
+    atomic<size_t> next(0);
+    exception_ptr failure;
+    mutex failureLock;
+    auto work = [&]() {
+        try {
+            for (size_t i = next++; i < count; i = next++) body(i);
+        }
+        catch (...) {
+            lock_guard<mutex> guard(failureLock);
+            if (!failure) failure = current_exception();
+        }
+    };
+    vector<thread> workers;
+    size_t extra = min<size_t>(threads, count) - 1;
+    for (size_t i = 0; i < extra; ++i) workers.emplace_back(work);
+    work();
+    for (auto& worker : workers) worker.join();
+    if (failure) rethrow_exception(failure);
+}
+
+// Свойства хранятся вектором, отсортированным по имени ключа (при повторе ключа остаётся
+// последнее значение), так что обход при выводе идёт по непрерывной памяти
+class ObjectNode : public ASTNode {
+public:
+    typedef pair<const Symbol*, NodeRef<ASTNode>> Property;
+    typedef SmallVector<Property, inlineChildren> Properties;
+private:
+    Properties properties;
+    mutable JsonSize cachedSize;
+    mutable bool sizeKnown = false;
+
+    // "  \"ключ\": значение" на отступе indent + 2 (без разделителя ",\n")
+    static size_t propertySize(const Properties::value_type& prop, int indent) {
+        return indent + 2 + prop.first->json.size() + prop.second->jsonSize().at(indent + 2);
+    }
+    static char* writeProperty(char* out, const Properties::value_type& prop, int indent) {
+        memset(out, ' ', indent + 2);
+        out += indent + 2;
+        out = writeBytes(out, prop.first->json.data(), prop.first->json.size());
+        return prop.second->writeJSON(out, indent + 2);
+    }
+    static bool keyLess(const Property& a, const Property& b) {
+        return SymbolLess()(a.first, b.first);
+    }
+
+public:
+    // Вставка с сохранением порядка; повторный ключ заменяет значение
+    void addProperty(const Symbol& key, NodeRef<ASTNode> value) {
+        Property property(&key, move(value));
+        if (properties.empty() || keyLess(properties.back(), property)) {
+            properties.push_back(move(property));
+            return;
+        }
+        auto position = lower_bound(properties.begin(), properties.end(), property, keyLess);
+        if (position->first == &key) position->second = move(property.second);
+        else properties.insert(position - properties.begin(), move(property));
+    }
+    void addProperty(const string& key, NodeRef<ASTNode> value) {
+        addProperty(SymbolTable::shared().intern(key), move(value));
+    }
+    void reserve(size_t count) { properties.reserve(count); }
+    void useArena(NodeArena* arena) { properties.useArena(arena); }
+
+    // Добавление без упорядочивания для разбора: после последнего свойства нужен sortProperties()
+    void appendProperty(const Symbol& key, NodeRef<ASTNode> value) {
+        properties.push_back(Property(&key, move(value)));
+    }
+    // Устойчивая сортировка по ключу; из одинаковых ключей остаётся последнее значение
+    void sortProperties() {
+        if (is_sorted(properties.begin(), properties.end(), keyLess)) {
+            // уже упорядочено, но возможны подряд идущие повторы
+            bool unique = adjacent_find(properties.begin(), properties.end(),
+                [](const Property& a, const Property& b) { return a.first == b.first; }) == properties.end();
+            if (unique) return;
+        }
+        else if (properties.size() <= 32) {
+            // вставками: без временного буфера stable_sort, который выделялся бы при каждом разборе
+            for (size_t i = 1; i < properties.size(); ++i) {
+                for (size_t j = i; j > 0 && keyLess(properties[j], properties[j - 1]); --j) {
+                    swap(properties[j], properties[j - 1]);
+                }
+            }
+        }
+        else {
+            stable_sort(properties.begin(), properties.end(), keyLess);
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < properties.size(); ++i) {
+            if (i + 1 < properties.size() && properties[i + 1].first == properties[i].first) continue;
+            if (kept != i) properties[kept] = move(properties[i]);
+            kept++;
+        }
+        properties.truncate(kept);
+    }
+    const Properties& getProperties() const { return properties; }
+    string toJSON(int indent = 0) const override {
+        if (properties.empty()) return "{}";
+
+        string result = "{";
+        StringOutput out{ result };
+        const IndentTable& indentation = IndentTable::standard();
+        bool first = true;
+        for (const auto& prop : properties) {
+            indentation.write(out, indent + 2, !first);
+            result += prop.first->json;
+            result += prop.second->toJSON(indent + 2);
+            first = false;
+        }
+        indentation.write(out, indent);
+        result += '}';
+        return result;
+    }
+    void emit(Emitter& emitter) const override {
+        emitter.beginObject(properties.size());
+        for (const auto& prop : properties) {
+            emitter.key(*prop.first);
+            prop.second->emit(emitter);
+        }
+        emitter.endObject();
+    }
+    JsonSize jsonSize() const override {
+        if (!sizeKnown) {
+            if (properties.empty()) {
+                cachedSize = { 2, 0 };
+            }
+            else {
+                // "{\n" + свойства через ",\n" + "\n" + отступ + "}"
+                size_t base = 2 + 2 * (properties.size() - 1) + 2;
+                size_t lines = properties.size() + 1;
+                for (const auto& prop : properties) {
+                    JsonSize value = prop.second->jsonSize();
+                    base += 2 + prop.first->json.size() + value.at(2);
+                    lines += value.lines;
+                }
+                cachedSize = { base, lines };
+            }
+            sizeKnown = true;
+        }
+        return cachedSize;
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        if (properties.empty()) return writeBytes(out, "{}", 2);
+        out = writeBytes(out, "{\n", 2);
+        bool first = true;
+        for (const auto& prop : properties) {
+            if (!first) out = writeBytes(out, ",\n", 2);
+            out = writeProperty(out, prop, indent);
+            first = false;
+        }
+        *out++ = '\n';
+        memset(out, ' ', indent);
+        out += indent;
+        *out++ = '}';
+        return out;
+    }
+    void account(MemoryReport& report) const override {
+        report.add("ObjectNode", sizeof(*this));
+        report.add("буферы свойств объектов", properties.heapBytes(), properties.isInline() ? 0 : 1);
+        for (const auto& prop : properties) accountNode(report, prop.second);
+    }
+
+    // То же, что writeJSON(out), но свойства делятся на непересекающиеся диапазоны байт,
+    // которые заполняются параллельно. Смещения известны заранее из jsonSize()
+    void writeJSONParallel(char* out, unsigned threads) const {
+        if (properties.empty() || threads <= 1) {
+            writeJSON(out);
+            return;
+        }
+        vector<const Properties::value_type*> props;
+        vector<size_t> offsets;
+        size_t position = 2;
+        for (const auto& prop : properties) {
+            props.push_back(&prop);
+            offsets.push_back(position);
+            position += propertySize(prop, 0) + 2;
+        }
+        size_t total = jsonSize().at(0);
+
+        // группы соседних свойств примерно равного размера
+        size_t groups = min<size_t>(props.size(), threads * 4);
+        size_t target = (total + groups - 1) / groups;
+        vector<size_t> bounds(1, 0);
+        for (size_t i = 1; i < props.size(); ++i) {
+            if (offsets[i] - offsets[bounds.back()] >= target) bounds.push_back(i);
+        }
+        bounds.push_back(props.size());
+
+        writeBytes(out, "{\n", 2);
+        parallelFor(bounds.size() - 1, threads, [&](size_t group) {
+            for (size_t i = bounds[group]; i < bounds[group + 1]; ++i) {
+                char* end = writeProperty(out + offsets[i], *props[i], 0);
+                if (i + 1 < props.size()) writeBytes(end, ",\n", 2);
+            }
+        });
+        writeBytes(out + total - 2, "\n}", 2);
+    }
+};
+
+// Источник входных данных для потокового лексера. read() возвращает столько байт,
+// сколько уже доступно (но не больше capacity), и 0 в конце входа
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+    virtual size_t read(char* buffer, size_t capacity) = 0;
+};
+
+// Чтение из файлового дескриптора (stdin): не ждёт заполнения всего блока
+class DescriptorSource : public InputSource {
+    int fd;
+public:
+    DescriptorSource(int descriptor) : fd(descriptor) {}
+    size_t read(char* buffer, size_t capacity) override {
+        while (true) {
+#ifdef _WIN32
+            int n = _read(fd, buffer, static_cast<unsigned int>(capacity));
+#else
+            ssize_t n = ::read(fd, buffer, capacity);
+#endif
+            if (n >= 0) return static_cast<size_t>(n);
+            if (errno != EINTR) {
+                throw runtime_error("Ошибка чтения входного потока");
+            }
+        }
+    }
+};
+
+class StreamSource : public InputSource {
+    istream& in;
+public:
+    StreamSource(istream& stream) : in(stream) {}
+    size_t read(char* buffer, size_t capacity) override {
+        in.read(buffer, capacity);
+        return static_cast<size_t>(in.gcount());
+    }
+};
+
+// Входной файл целиком. На POSIX обычный файл отображается в память только для чтения,
+// и строки дерева ссылаются прямо на его страницы; иначе (пустой файл, канал, Windows) —
+// обычное чтение в строку. Объект должен жить дольше дерева, построенного по его тексту
+class InputFile {
+    string contents;
+    const char* start = nullptr;
+    size_t length = 0;
+    void* mapping = nullptr;
+
+public:
+    explicit InputFile(const string& path) {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            struct stat info;
+            if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+                void* pages = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (pages != MAP_FAILED) {
+                    mapping = pages;
+                    start = static_cast<const char*>(pages);
+                    length = static_cast<size_t>(info.st_size);
+                    madvise(pages, length, MADV_SEQUENTIAL);
+                }
+            }
+            close(fd);
+            if (mapping) return;
+        }
+#endif
+        ifstream inFile(path);
+        if (!inFile) {
+            throw runtime_error("Не удается открыть входной файл: " + path);
+        }
+        stringstream buffer;
+        buffer << inFile.rdbuf();
+        contents = buffer.str();
+        start = contents.data();
+        length = contents.size();
+    }
+    InputFile(const InputFile&) = delete;
+    InputFile& operator=(const InputFile&) = delete;
+    ~InputFile() {
+#ifndef _WIN32
+        if (mapping) munmap(mapping, length);
+#endif
+    }
+
+    const char* data() const { return start; }
+    size_t size() const { return length; }
+};
+
+class Lexer {
+    // собственная копия текста или блоки из потокового источника
+    string storage;
+    // разбираемый текст: либо storage, либо внешний буфер, которым лексер не владеет
+    const char* input;
+    size_t length;
+    size_t position;
+    int line;
+    int column;
+    InputSource* source;
+    size_t chunkSize;
+    bool external;
+    // байты, отброшенные из storage в потоковом режиме
+    size_t discarded = 0;
+    const CancellationToken* cancellation = nullptr;
+    unsigned sinceCheck = 0;
+
+    // Догружает очередной блок из источника. Уже прочитанная часть буфера отбрасывается:
+    // незаконченный токен накапливается в nextToken(), так что переносить нужно только хвост
+    bool refill() {
+        if (!source) return false;
+        discarded += position;
+        storage.erase(0, position);
+        position = 0;
+        size_t old = storage.length();
+        storage.resize(old + chunkSize);
+        size_t n = source->read(&storage[old], chunkSize);
+        storage.resize(old + n);
+        input = storage.data();
+        length = storage.length();
+        if (n == 0) source = nullptr;
+        return n > 0;
+    }
+
+    // есть ли во входе символ position + offset (при необходимости догружает данные)
+    bool available(size_t offset = 0) {
+        while (position + offset >= length) {
+            if (!refill()) return false;
+        }
+        return true;
+    }
+
+    char peek() {
+        return available() ? input[position] : '\0';
+    }
+
+    char advance() {
+        char c = peek();
+        if (c != '\0') {
+            position++;
+            if (c == '\n') {
+                line++;
+                column = 1;
+            }
+            else {
+                column++;
+            }
+        }
+        return c;
+    }
+
+    // Сдвигает позицию на count уже загруженных байт, учитывая переводы строк
+    void skip(size_t count) {
+        const char* start = input + position;
+        const char* end = start + count;
+        const char* lastNewline = nullptr;
+        for (const char* p = start; (p = static_cast<const char*>(memchr(p, '\n', end - p))); ++p) {
+            line++;
+            lastNewline = p;
+        }
+        if (lastNewline) column = 1 + static_cast<int>(end - lastNewline - 1);
+        else column += static_cast<int>(count);
+        position += count;
+    }
+
+    // Пропускает серию байтов, длину которой в загруженной части находит ядро scan,
+    // догружая вход, пока серия не закончится. Байты серии добавляются в text, если он задан
+    void consumeRun(size_t (*scan)(const char*, size_t), string* text) {
+        while (available()) {
+            size_t count = scan(input + position, length - position);
+            if (text) text->append(input + position, count);
+            skip(count);
+            if (position < length) break;
+        }
+    }
+
+    void skipWhitespace() {
+        consumeRun(textKernels.skipSpaces, nullptr);
+    }
+
+    // Токен, текст которого не копируется, а указывает во внешний буфер
+    Token spanToken(TokenType type, size_t (*scan)(const char*, size_t), int startLine, int startColumn) {
+        Token token(type, "", startLine, startColumn);
+        token.span = input + position;
+        token.spanSize = scan(token.span, length - position);
+        skip(token.spanSize);
+        return token;
+    }
+
+public:
+    Lexer(const string& text)
+        : storage(text), input(storage.data()), length(storage.length()),
+        position(0), line(1), column(1), source(nullptr), chunkSize(0), external(false) {
+    }
+
+    // Разбор внешнего буфера без копирования, начиная с позиции start.
+    // Буфер должен жить, пока используется лексер и построенное по нему дерево
+    Lexer(const char* text, size_t size, size_t start = 0, int startLine = 1, int startColumn = 1)
+        : input(text), length(size), position(start), line(startLine), column(startColumn),
+        source(nullptr), chunkSize(0), external(true) {
+    }
+
+    // Потоковый режим: токенизация начинается, как только пришёл первый блок
+    Lexer(InputSource& in, size_t chunk = 64 * 1024)
+        : input(nullptr), length(0), position(0), line(1), column(1),
+        source(&in), chunkSize(chunk > 0 ? chunk : 1), external(false) {
+    }
+
+    // Внешний буфер, по которому можно повторно пройти с любой позиции (не потоковый режим)
+    bool isReplayable() const { return external; }
+    const char* text() const { return input; }
+    size_t size() const { return length; }
+    size_t offset() const { return position; }
+    // сколько байт входа пройдено с начала разбора (и в потоковом режиме)
+    size_t consumed() const { return discarded + position; }
+    int currentLine() const { return line; }
+    int currentColumn() const { return column; }
+
+    // Разбор прервётся исключением ConversionCancelled, если token отменят или истечёт его срок
+    void cancelWith(const CancellationToken* token) { cancellation = token; }
+
+    Token nextToken() {
+        if (cancellation && ++sinceCheck == cancellationInterval) {
+            sinceCheck = 0;
+            cancellation->check();
+        }
+        skipWhitespace();
+
+        if (!available()) {
+            return Token(TokenType::EOF_TOKEN, "", line, column);
+        }
+
+        char current = peek();
+        int startLine = line;
+        int startColumn = column;
+
+        if (current == '0' && available(1) &&
+            (input[position + 1] == 'x' || input[position + 1] == 'X')) {
+            advance();
+            advance();
+            if (external) return spanToken(TokenType::NUMBER, textKernels.hexDigits, startLine, startColumn);
+            string number;
+            consumeRun(textKernels.hexDigits, &number);
+            return Token(TokenType::NUMBER, number, startLine, startColumn);
+        }
+
+        if (isalpha(current)) {
+            if (external) {
+                Token token = spanToken(TokenType::IDENTIFIER, textKernels.identifier, startLine, startColumn);
+                if (token.spanSize <= 6) {
+                    string word(token.span, token.spanSize);
+                    if (word == "global") return Token(TokenType::GLOBAL, word, startLine, startColumn);
+                    if (word == "true" || word == "false") return Token(TokenType::STRING, word, startLine, startColumn);
+                }
+                return token;
+            }
+            string identifier;
+            consumeRun(textKernels.identifier, &identifier);
+            if (identifier == "global") return Token(TokenType::GLOBAL, identifier, startLine, startColumn);
+            if (identifier == "true" || identifier == "false") return Token(TokenType::STRING, identifier, startLine, startColumn);
+            return Token(TokenType::IDENTIFIER, identifier, startLine, startColumn);
+        }
+
+        if (current == '"') {
+            advance();
+            if (external) {
+                // текст живёт дольше лексера: строка не копируется, токен ссылается на буфер
+                Token token = spanToken(TokenType::STRING, textKernels.stringBody, startLine, startColumn);
+                if (token.spanSize == 4 || token.spanSize == 5) {
+                    // "true" и "false" в кавычках тоже становятся логическими значениями
+                    string word(token.span, token.spanSize);
+                    if (word == "true" || word == "false") token.value = word;
+                }
+                if (peek() == '"') advance();
+                return token;
+            }
+            string str;
+            consumeRun(textKernels.stringBody, &str);
+            if (peek() == '"') advance();
+            return Token(TokenType::STRING, str, startLine, startColumn);
+        }
+
+        // одиночные символы
+        switch (current) {
+        case '{': advance(); return Token(TokenType::LBRACE, "{", startLine, startColumn);
+        case '}': advance(); return Token(TokenType::RBRACE, "}", startLine, startColumn);
+        case '[': advance(); return Token(TokenType::LBRACKET, "[", startLine, startColumn);
+        case ']': advance(); return Token(TokenType::RBRACKET, "]", startLine, startColumn);
+        case '(': advance(); return Token(TokenType::LPAREN, "(", startLine, startColumn);
+        case ')': advance(); return Token(TokenType::RPAREN, ")", startLine, startColumn);
+        case '#': advance(); return Token(TokenType::HASH, "#", startLine, startColumn);
+        case '=': advance(); return Token(TokenType::EQUALS, "=", startLine, startColumn);
+        case '?': advance(); return Token(TokenType::QUESTION, "?", startLine, startColumn);
+        }
+
+        // неизвестный символ
+        string invalidChar(1, current);
+        advance();
+        return Token(TokenType::INVALID, invalidChar, startLine, startColumn);
+    }
+};
+
+// Результат предварительного прохода по тексту: число детей каждой "{" и "#(" в порядке
+// их появления (для объекта — число записей, повторы ключей тоже считаются), число записей
+// верхнего уровня и общее число токенов, по которому можно заранее оценить объём дерева
+struct InputShape {
+    vector<size_t> children;
+    size_t topLevel = 0;
+    size_t tokens = 0;
+};
+
+// Только токенизация, без построения узлов; ошибки синтаксиса не проверяются — их найдёт разбор
+InputShape countShape(const char* text, size_t size) {
+    InputShape shape;
+    Lexer lexer(text, size);
+    // индексы открытых контейнеров в shape.children и признак массива
+    vector<pair<size_t, bool>> open;
+    bool constant = false;
+    // предыдущий токен — "=" верхнего уровня
+    bool topLevelValue = false;
+    for (Token token = lexer.nextToken(); token.type != TokenType::EOF_TOKEN; token = lexer.nextToken()) {
+        // недопустимый символ '\0' лексер не пропускает; об ошибке сообщит разбор
+        if (token.type == TokenType::INVALID) break;
+        shape.tokens++;
+        bool inArray = !open.empty() && open.back().second;
+        bool valueExpected = topLevelValue;
+        topLevelValue = false;
+        switch (token.type) {
+        case TokenType::NUMBER:
+        case TokenType::STRING:
+        case TokenType::HASH:
+        case TokenType::QUESTION:
+            if (inArray) shape.children[open.back().first]++;
+            break;
+        case TokenType::LBRACE:
+            if (inArray) shape.children[open.back().first]++;
+            // безымянный объект верхнего уровня — отдельная запись "unnamed"
+            else if (open.empty() && !valueExpected) shape.topLevel++;
+            open.push_back(make_pair(shape.children.size(), false));
+            shape.children.push_back(0);
+            break;
+        case TokenType::LPAREN:
+            open.push_back(make_pair(shape.children.size(), true));
+            shape.children.push_back(0);
+            break;
+        case TokenType::RBRACE:
+        case TokenType::RPAREN:
+            if (!open.empty()) open.pop_back();
+            break;
+        case TokenType::GLOBAL:
+            if (open.empty()) constant = true;
+            break;
+        case TokenType::EQUALS:
+            if (!open.empty()) {
+                shape.children[open.back().first]++;
+                break;
+            }
+            topLevelValue = true;
+            if (constant) constant = false;
+            else shape.topLevel++;
+            break;
+        default:
+            break;
+        }
+    }
+    return shape;
+}
+
+// Временный файл для режима выгрузки (--spill): готовые большие поддеревья дописываются в него
+// в формате CBOR, а в дереве вместо них остаются SpilledNode со смещением и размером JSON.
+// Уже выгруженные части внутри выгружаемого поддерева не копируются, а записываются ссылкой:
+// тег spillReferenceTag с парой [смещение, число значений]. При выводе значения читаются
+// по смещению и воспроизводятся событиями Emitter, так что в памяти остаются только индекс
+// (ключи объектов и смещения) и буфер чтения. Файл удаляется при закрытии
+class SpillFile {
+    static const uint64_t spillReferenceTag = 0x636c74;
+    int fd;
+    size_t spillThreshold;
+    unique_ptr<OutputSink> sink;
+    unique_ptr<CborEmitter> writer;
+    size_t values = 0;
+    // Ключи воспроизводимых объектов; вывод частями воспроизводит из нескольких потоков
+    mutable SymbolTable keys{true};
+#ifdef _WIN32
+    // _read читает с общей позиции файла, поэтому сдвиг и чтение идут под блокировкой
+    mutable mutex positionLock;
+#endif
+
+    // Буферизированное чтение файла с произвольного смещения; у каждого воспроизведения свой курсор
+    class Cursor {
+        const SpillFile& file;
+        uint64_t position;
+        vector<char> buffer;
+        size_t begin = 0;
+        size_t end = 0;
+
+        void fill() {
+#ifdef _WIN32
+            lock_guard<mutex> guard(file.positionLock);
+            _lseeki64(file.fd, static_cast<__int64>(position), SEEK_SET);
+            int n = _read(file.fd, buffer.data(), static_cast<unsigned int>(buffer.size()));
+#else
+            ssize_t n = pread(file.fd, buffer.data(), buffer.size(), static_cast<off_t>(position));
+#endif
+            if (n <= 0) throw runtime_error("Ошибка чтения временного файла выгрузки");
+            position += static_cast<uint64_t>(n);
+            begin = 0;
+            end = static_cast<size_t>(n);
+        }
+
+    public:
+        Cursor(const SpillFile& owner, uint64_t offset) : file(owner), position(offset), buffer(64 * 1024) {}
+
+        uint8_t byte() {
+            if (begin == end) fill();
+            return static_cast<uint8_t>(buffer[begin++]);
+        }
+        uint8_t peek() {
+            if (begin == end) fill();
+            return static_cast<uint8_t>(buffer[begin]);
+        }
+        void read(string& out, size_t size) {
+            out.clear();
+            while (out.size() < size) {
+                if (begin == end) fill();
+                size_t take = min(size - out.size(), end - begin);
+                out.append(buffer.data() + begin, take);
+                begin += take;
+            }
+        }
+        // аргумент заголовка CBOR по его дополнительной информации
+        uint64_t argument(uint8_t info) {
+            if (info < 24) return info;
+            int bytes = info == 24 ? 1 : info == 25 ? 2 : info == 26 ? 4 : 8;
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; ++i) value = (value << 8) | byte();
+            return value;
+        }
+    };
+
+    // Воспроизводит одно значение; возвращает, сколько значений получил out (ссылка даёт несколько)
+    size_t replayValue(Cursor& in, Emitter& out, string& text) const {
+        uint8_t initial = in.byte();
+        uint8_t major = initial >> 5;
+        uint8_t info = initial & 31;
+        if (major == 7) {
+            out.boolean(info == 21);
+            return 1;
+        }
+        bool indefinite = info == 31;
+        uint64_t value = indefinite ? 0 : in.argument(info);
+        switch (major) {
+        case 0:
+            out.number(static_cast<long long>(value));
+            return 1;
+        case 1:
+            out.number(-1 - static_cast<long long>(value));
+            return 1;
+        case 3:
+            in.read(text, static_cast<size_t>(value));
+            out.stringValue(text.data(), text.size());
+            return 1;
+        case 4: {
+            out.beginArray(indefinite ? unknownSize : static_cast<size_t>(value));
+            for (size_t emitted = 0; indefinite || emitted < value;) {
+                if (indefinite && in.peek() == 0xff) {
+                    in.byte();
+                    break;
+                }
+                emitted += replayValue(in, out, text);
+            }
+            out.endArray();
+            return 1;
+        }
+        case 5:
+            out.beginObject(indefinite ? unknownSize : static_cast<size_t>(value));
+            for (uint64_t i = 0; indefinite || i < value; ++i) {
+                uint8_t keyHead = in.byte();
+                if (keyHead == 0xff) break;
+                in.read(text, static_cast<size_t>(in.argument(keyHead & 31)));
+                out.key(keys.intern(text));
+                replayValue(in, out, text);
+            }
+            out.endObject();
+            return 1;
+        case 6: {
+            // ссылка на значения, выгруженные раньше: [смещение, число значений]
+            if (value != spillReferenceTag) throw runtime_error("Повреждён временный файл выгрузки");
+            in.byte();
+            uint64_t offset = in.argument(in.byte() & 31);
+            uint64_t count = in.argument(in.byte() & 31);
+            replay(offset, out, static_cast<size_t>(count));
+            return static_cast<size_t>(count);
+        }
+        default:
+            throw runtime_error("Повреждён временный файл выгрузки");
+        }
+    }
+
+public:
+    // Файл создаётся в каталоге directory; поддеревья длиннее threshold байт входа выгружаются
+    SpillFile(const string& directory, size_t threshold = 1024 * 1024) : spillThreshold(threshold) {
+#ifdef _WIN32
+        char* name = _tempnam(directory.c_str(), "clt-spill-");
+        // _O_APPEND: запись не зависит от позиции, которую сдвигает чтение
+        fd = name ? _open(name, _O_RDWR | _O_CREAT | _O_EXCL | _O_BINARY | _O_TEMPORARY | _O_APPEND, _S_IREAD | _S_IWRITE) : -1;
+        free(name);
+#else
+        string pattern = directory + "/clt-spill-XXXXXX";
+        vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+        fd = mkstemp(name.data());
+        // имя сразу удаляется: файл исчезнет вместе с последним дескриптором
+        if (fd >= 0) unlink(name.data());
+#endif
+        if (fd < 0) {
+            throw runtime_error("Не удается создать временный файл выгрузки в " + directory);
+        }
+        sink.reset(new OutputSink(fd));
+        writer.reset(new CborEmitter(*sink));
+    }
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+    ~SpillFile() {
+        writer.reset();
+        sink.reset();
+        closeDescriptor(fd);
+    }
+
+    size_t threshold() const { return spillThreshold; }
+    // выгружено значений и байт
+    size_t count() const { return values; }
+    uint64_t bytes() const { return sink->written(); }
+
+    // Дописывает значения подряд и возвращает смещение первого. Значения сразу сбрасываются
+    // в файл: SpilledNode появляется только после этого, и воспроизведению не нужен буфер записи
+    template <class Range>
+    uint64_t append(const Range& nodes) {
+        uint64_t offset = sink->written();
+        for (const auto& node : nodes) {
+            node->emit(*writer);
+            values++;
+        }
+        sink->flush();
+        return offset;
+    }
+
+    // Выгруженное значение внутри выгружаемого поддерева записывается ссылкой, а не копией
+    bool isWriter(const Emitter& emitter) const { return &emitter == writer.get(); }
+    void reference(uint64_t offset, size_t count) {
+        char buffer[9];
+        sink->write(buffer, cborHead(buffer, 6, spillReferenceTag));
+        sink->write(buffer, cborHead(buffer, 4, 2));
+        sink->write(buffer, cborHead(buffer, 0, offset));
+        sink->write(buffer, cborHead(buffer, 0, count));
+    }
+
+    // Воспроизводит count значений, записанных подряд с offset. Файл только читается, поэтому
+    // вывод частями и вывод по мере разбора могут воспроизводить из разных потоков
+    void replay(uint64_t offset, Emitter& out, size_t count = 1) const {
+        Cursor in(*this, offset);
+        string text;
+        for (size_t emitted = 0; emitted < count;) emitted += replayValue(in, out, text);
+    }
+};
+
+// Каталог для временных файлов по умолчанию
+string temporaryDirectory() {
+#ifdef _WIN32
+    const char* directory = getenv("TEMP");
+    return directory ? directory : ".";
+#else
+    const char* directory = getenv("TMPDIR");
+    return directory && *directory ? directory : "/tmp";
+#endif
+}
+
+// JSON выгруженного поддерева для toJSON()/writeJSON(): воспроизводится в строку с нужным отступом
+inline string spilledJSON(const ASTNode& node, int indent) {
+    ostringstream text;
+    {
+        OutputSink sink(text);
+        JsonEmitter emitter(sink, IndentTable::standard(), indent);
+        node.emit(emitter);
+    }
+    return text.str();
+}
+
+// Выгруженное поддерево: в памяти только смещение в SpillFile и размер JSON
+class SpilledNode : public ASTNode {
+    SpillFile& file;
+    uint64_t offset;
+    JsonSize size;
+public:
+    SpilledNode(SpillFile& spill, uint64_t position, JsonSize jsonBytes)
+        : file(spill), offset(position), size(jsonBytes) {
+    }
+    string toJSON(int indent = 0) const override { return spilledJSON(*this, indent); }
+    void emit(Emitter& emitter) const override {
+        if (file.isWriter(emitter)) file.reference(offset, 1);
+        else file.replay(offset, emitter);
+    }
+    JsonSize jsonSize() const override { return size; }
+    char* writeJSON(char* out, int indent = 0) const override {
+        string text = toJSON(indent);
+        return writeBytes(out, text.data(), text.size());
+    }
+    void account(MemoryReport& report) const override {
+        report.add("SpilledNode", sizeof(*this));
+    }
+};
+
+// Массив, элементы которого выгружаются кусками по мере разбора: в памяти остаются только
+// смещения кусков, так что массив может быть больше доступной памяти
+class SpilledArrayNode : public ASTNode {
+    SpillFile& file;
+    vector<pair<uint64_t, size_t>> runs;
+    size_t count = 0;
+    size_t base = 2;
+public:
+    explicit SpilledArrayNode(SpillFile& spill) : file(spill) {}
+
+    // Выгружает элементы run следующим куском
+    void addRun(const ArrayNode& run) {
+        const ArrayNode::Elements& elements = run.getElements();
+        for (const auto& element : elements) base += element->jsonSize().base;
+        runs.push_back(make_pair(file.append(elements), elements.size()));
+        count += elements.size();
+    }
+    size_t size() const { return count; }
+
+    string toJSON(int indent = 0) const override { return spilledJSON(*this, indent); }
+    void emit(Emitter& emitter) const override {
+        emitter.beginArray(count);
+        for (const auto& run : runs) {
+            if (file.isWriter(emitter)) file.reference(run.first, run.second);
+            else file.replay(run.first, emitter, run.second);
+        }
+        emitter.endArray();
+    }
+    JsonSize jsonSize() const override {
+        // как у ArrayNode: скобки и разделители ", " — 2 байта на элемент
+        return { count == 0 ? size_t(2) : base - 2 + 2 * count, 0 };
+    }
+    char* writeJSON(char* out, int indent = 0) const override {
+        string text = toJSON(indent);
+        return writeBytes(out, text.data(), text.size());
+    }
+    void account(MemoryReport& report) const override {
+        report.add("SpilledArrayNode", sizeof(*this));
+        report.add("смещения выгруженных кусков", runs.capacity() * sizeof(runs[0]), runs.size());
+    }
+};
+
+// Состояние, которое переживает парсер и достаётся следующему разбору (см. Converter):
+// таблица констант, буфер для текста токенов, арена для узлов и таблица ключей
+struct ParseState {
+    map<string, NodeRef<ASTNode>> constants;
+    string tokenText;
+    NodeArena* arena = nullptr;
+    SymbolTable* symbols = &SymbolTable::shared();
+
+    // Значения констант освобождаются, а имена остаются, чтобы не выделять их заново;
+    // пустое значение — константа не определена
+    void reset() {
+        if (constants.size() > 1024) constants.clear();
+        for (auto& constant : constants) constant.second.reset();
+    }
+};
+
+class Parser {
+    Lexer& lexer;
+    Token currentToken;
+    ParseState ownState;
+    ParseState& state;
+    // константы потокового массива при повторном разборе (см. BorrowedNode)
+    const map<string, NodeRef<ASTNode>>* borrowedConstants = nullptr;
+    // пути (ключи через точку), массивы по которым выводятся потоково
+    set<string> streamedArrayPaths;
+    string currentPath;
+    int arrayDepth = 0;
+    bool inConstant = false;
+    StringPool* strings = nullptr;
+    const InputShape* shape = nullptr;
+    size_t nextContainer = 0;
+    SpillFile* spill = nullptr;
+    size_t depth = 0;
+    size_t depthLimit = ConversionLimits::defaultDepth;
+    size_t nodes = 0;
+    size_t nodeLimit = SIZE_MAX;
+    // > 0, пока идёт проверочный проход потокового массива (см. parseStreamedArray)
+    int validating = 0;
+
+    // ёмкость очередного контейнера из предварительного прохода (0, если его не было)
+    size_t reservedChildren() {
+        if (!shape || nextContainer >= shape->children.size()) return 0;
+        return shape->children[nextContainer++];
+    }
+
+    template <class T, class... Args>
+    NodeRef<T> make(Args&&... args) {
+        if (++nodes > nodeLimit) {
+            throw LimitExceeded("превышено число узлов: больше " + to_string(nodeLimit) +
+                " в строке " + to_string(currentToken.line));
+        }
+        return makeNode<T>(nodeArena(), forward<Args>(args)...);
+    }
+
+    // Арена для новых узлов. Элементы потокового массива при проверке создаются в куче и
+    // освобождаются сразу после разбора: в арене, которая сбрасывается только целиком,
+    // они копились бы до конца разбора всего массива
+    NodeArena* nodeArena() const { return validating ? nullptr : state.arena; }
+
+    // Вход в массив или объект; выход — leave(). Ограничение глубины защищает и стек рекурсивного разбора
+    void enter() {
+        if (++depth > depthLimit) {
+            throw LimitExceeded("превышена глубина вложенности: больше " + to_string(depthLimit) +
+                " в строке " + to_string(currentToken.line));
+        }
+    }
+    void leave() { depth--; }
+
+    // Текст текущего токена; текст-ссылка копируется в буфер состояния, а не в новую строку
+    const string& tokenText() {
+        if (!currentToken.span) return currentToken.value;
+        state.tokenText.assign(currentToken.span, currentToken.spanSize);
+        return state.tokenText;
+    }
+
+    // Значение константы или nullptr, если она не определена
+    NodeRef<ASTNode> constantValue(const string& name) {
+        if (borrowedConstants) {
+            auto found = borrowedConstants->find(name);
+            if (found == borrowedConstants->end() || !found->second) return nullptr;
+            return make<BorrowedNode>(*found->second);
+        }
+        auto found = state.constants.find(name);
+        return found == state.constants.end() ? nullptr : found->second;
+    }
+
+    // В режиме выгрузки заменяет большой готовый объект или массив ссылкой на временный файл;
+    // start — позиция входа перед значением
+    NodeRef<ASTNode> spillIfLarge(NodeRef<ASTNode> node, size_t start) {
+        if (!spill || validating || lexer.consumed() - start < spill->threshold()) return node;
+        if (!dynamic_cast<ObjectNode*>(node.get()) && !dynamic_cast<ArrayNode*>(node.get())) return node;
+        JsonSize size = node->jsonSize();
+        uint64_t offset = spill->append(vector<NodeRef<ASTNode>>{ node });
+        return make<SpilledNode>(*spill, offset, size);
+    }
+
+    // Массив в режиме выгрузки: элементы копятся в памяти и уходят в файл кусками
+    // примерно по threshold байт входа. Массив, не набравший ни одного куска, остаётся обычным
+    NodeRef<ASTNode> parseSpillingArray() {
+        eat(TokenType::LPAREN);
+        auto pending = make<ArrayNode>();
+        pending->reserve(reservedChildren());
+        auto spilled = make<SpilledArrayNode>(*spill);
+        size_t runStart = lexer.consumed();
+        arrayDepth++;
+        enter();
+        while (currentToken.type != TokenType::RPAREN && currentToken.type != TokenType::EOF_TOKEN) {
+            pending->addElement(parseValue());
+            if (lexer.consumed() - runStart >= spill->threshold()) {
+                spilled->addRun(*pending);
+                pending = make<ArrayNode>();
+                runStart = lexer.consumed();
+            }
+        }
+        leave();
+        arrayDepth--;
+        eat(TokenType::RPAREN);
+        if (spilled->size() == 0) return pending;
+        if (!pending->getElements().empty()) spilled->addRun(*pending);
+        return spilled;
+    }
+
+    void eat(TokenType expected) {
+        if (currentToken.type == expected) {
+            currentToken = lexer.nextToken();
+        }
+        else {
+            throw runtime_error("Синтаксическая ошибка в строке " + to_string(currentToken.line) +
+                ", column " + to_string(currentToken.column) +
+                ": expected " + tokenTypeToString(expected) +
+                ", got " + tokenTypeToString(currentToken.type));
+        }
+    }
+
+    string tokenTypeToString(TokenType type) {
+        switch (type) {
+        case TokenType::NUMBER: return "NUMBER";
+        case TokenType::STRING: return "STRING";
+        case TokenType::IDENTIFIER: return "IDENTIFIER";
+        case TokenType::LBRACE: return "LBRACE";
+        case TokenType::RBRACE: return "RBRACE";
+        case TokenType::LBRACKET: return "LBRACKET";
+        case TokenType::RBRACKET: return "RBRACKET";
+        case TokenType::LPAREN: return "LPAREN";
+        case TokenType::RPAREN: return "RPAREN";
+        case TokenType::HASH: return "HASH";
+        case TokenType::EQUALS: return "EQUALS";
+        case TokenType::QUESTION: return "QUESTION";
+        case TokenType::GLOBAL: return "GLOBAL";
+        case TokenType::EOF_TOKEN: return "EOF_TOKEN";
+        case TokenType::INVALID: return "INVALID";
+        default: return "UNKNOWN";
+        }
+    }
+
+    NodeRef<ASTNode> parseValue() {
+        if (currentToken.type == TokenType::NUMBER) {
+            long long value = stoll(currentToken.text(), nullptr, 16);
+            auto node = make<NumberNode>(value);
+            eat(TokenType::NUMBER);
+            return node;
+        }
+        else if (currentToken.type == TokenType::STRING) {
             if (currentToken.value == "true" || currentToken.value == "false") {
-                auto node = make_shared<BoolNode>(currentToken.value == "true");
+                auto node = make<BoolNode>(currentToken.value == "true");
+                eat(TokenType::STRING);
+                return node;
+            }
+            else {
+                NodeRef<ASTNode> node;
+                // проверяемые элементы потокового массива в пул не попадают (см. nodeArena)
+                if (strings && !validating) {
+                    node = currentToken.span
+                        ? strings->intern(currentToken.span, currentToken.spanSize)
+                        : strings->intern(currentToken.value.data(), currentToken.value.size());
+                }
+                else if (currentToken.span) {
+                    node = make<StringNode>(currentToken.span, currentToken.spanSize);
+                }
+                else {
+                    node = make<StringNode>(currentToken.value);
+                }
                 eat(TokenType::STRING);
                 return node;
             }
-            else {
-                auto node = make_shared<StringNode>(currentToken.value);
-                eat(TokenType::STRING);
-                return node;
+        }
+        else if (currentToken.type == TokenType::HASH) {
+            eat(TokenType::HASH);
+            if (!streamedArrayPaths.empty() && arrayDepth == 0 && !inConstant &&
+                streamedArrayPaths.count(currentPath) && lexer.isReplayable()) {
+                return parseStreamedArray();
+            }
+            if (spill && !validating) return parseSpillingArray();
+            eat(TokenType::LPAREN);
+            auto array = make<ArrayNode>();
+            array->useArena(nodeArena());
+            array->reserve(reservedChildren());
+            arrayDepth++;
+            enter();
+            while (currentToken.type != TokenType::RPAREN && currentToken.type != TokenType::EOF_TOKEN) {
+                array->addElement(parseValue());
+            }
+            leave();
+            arrayDepth--;
+            eat(TokenType::RPAREN);
+            return array;
+        }
+        else if (currentToken.type == TokenType::QUESTION) {
+            eat(TokenType::QUESTION);
+            eat(TokenType::LBRACKET);
+            NodeRef<ASTNode> value;
+            string unknown;
+            if (currentToken.type == TokenType::IDENTIFIER) {
+                value = constantValue(tokenText());
+                if (!value) unknown = tokenText();
+            }
+            eat(TokenType::IDENTIFIER);
+            eat(TokenType::RBRACKET);
+            if (!value) {
+                throw runtime_error("Неизвестная константа: " + unknown);
+            }
+            return value;
+        }
+        else if (currentToken.type == TokenType::LBRACE) {
+            return parseObject();
+        }
+
+        throw runtime_error("Неожиданный токен в значении: " + currentToken.text() + " в строке " + to_string(currentToken.line));
+    }
+
+    // Проверяет синтаксис массива и считает элементы, не сохраняя их. Позиция запоминается
+    // сразу после '(', чтобы при выводе начать повторный разбор с первого элемента.
+    // Каждый элемент живёт только до разбора следующего: он не попадает ни в арену, ни в пул
+    // строк, ни в файл выгрузки, так что память не растёт с длиной массива
+    NodeRef<ASTNode> parseStreamedArray() {
+        size_t start = lexer.offset();
+        int line = lexer.currentLine();
+        int column = lexer.currentColumn();
+        eat(TokenType::LPAREN);
+        // массив не хранится, но его место в очереди ёмкостей надо пропустить
+        reservedChildren();
+        size_t count = 0;
+        arrayDepth++;
+        validating++;
+        enter();
+        while (currentToken.type != TokenType::RPAREN && currentToken.type != TokenType::EOF_TOKEN) {
+            parseValue();
+            count++;
+        }
+        leave();
+        validating--;
+        arrayDepth--;
+        eat(TokenType::RPAREN);
+        return make<StreamedArrayNode>(lexer.text(), lexer.size(), start, line, column, state.constants, count);
+    }
+
+    NodeRef<ObjectNode> parseObject() {
+        auto obj = make<ObjectNode>();
+        obj->useArena(nodeArena());
+        obj->reserve(reservedChildren());
+        eat(TokenType::LBRACE);
+        enter();
+
+        while (currentToken.type != TokenType::RBRACE && currentToken.type != TokenType::EOF_TOKEN) {
+            if (currentToken.type == TokenType::IDENTIFIER) {
+                const Symbol& key = state.symbols->intern(tokenText());
+                eat(TokenType::IDENTIFIER);
+                eat(TokenType::EQUALS);
+                size_t parentLength = currentPath.length();
+                if (!streamedArrayPaths.empty()) currentPath += "." + key.name;
+                size_t start = lexer.consumed();
+                auto value = spillIfLarge(parseValue(), start);
+                currentPath.resize(parentLength);
+                obj->appendProperty(key, move(value));
+            }
+            else {
+                throw runtime_error("Ожидаемый идентификатор в объекте");
+            }
+        }
+
+        leave();
+        eat(TokenType::RBRACE);
+        obj->sortProperties();
+        return obj;
+    }
+
+public:
+    Parser(Lexer& l) : lexer(l), currentToken(l.nextToken()), state(ownState) {}
+
+    // Парсер с внешним состоянием: константы остаются в shared после разбора, узлы
+    // создаются в shared.arena, если она задана
+    Parser(Lexer& l, ParseState& shared) : lexer(l), currentToken(l.nextToken()), state(shared) {}
+
+    // Парсер для повторного разбора элементов потокового массива с сохранёнными константами.
+    // Константы не копируются и должны жить дольше разобранных элементов
+    Parser(Lexer& l, const map<string, NodeRef<ASTNode>>& consts)
+        : lexer(l), currentToken(l.nextToken()), state(ownState), borrowedConstants(&consts) {
+    }
+
+    // Массив по этому пути (например, "telemetry.buckets") не будет храниться в памяти целиком.
+    // Работает только для лексера по внешнему буферу, который доступен и во время вывода
+    void streamArrayAt(const string& path) {
+        streamedArrayPaths.insert(path);
+    }
+
+    // Одинаковые строковые значения станут одним узлом из пула. Пул должен жить дольше дерева.
+    // Строки потоковых массивов остаются обычными узлами: проверочный проход их не интернирует
+    // (см. nodeArena), а при выводе элементы разбирает отдельный парсер без пула
+    void internStrings(StringPool& pool) {
+        strings = &pool;
+    }
+
+    // Контейнеры сразу получают точную ёмкость из countShape() по тому же тексту,
+    // который разбирает этот парсер. Результат прохода должен жить до конца разбора
+    void presize(const InputShape& counted) {
+        shape = &counted;
+        nextContainer = 0;
+    }
+
+    // Режим для входов больше памяти: готовые поддеревья длиннее file.threshold() байт входа
+    // выгружаются в file, который должен жить дольше дерева
+    void spillTo(SpillFile& file) {
+        spill = &file;
+    }
+
+    // Ограничения глубины и числа узлов (limits.outputBytes проверяет вывод, а не парсер)
+    void limit(const ConversionLimits& limits) {
+        depthLimit = limits.depth > 0 ? limits.depth : SIZE_MAX;
+        nodeLimit = limits.nodes > 0 ? limits.nodes : SIZE_MAX;
+    }
+
+    // Очередной элемент массива или nullptr на закрывающей скобке
+    NodeRef<ASTNode> nextArrayElement() {
+        if (currentToken.type == TokenType::RPAREN || currentToken.type == TokenType::EOF_TOKEN) {
+            return nullptr;
+        }
+        arrayDepth++;
+        auto element = parseValue();
+        arrayDepth--;
+        return element;
+    }
+
+    NodeRef<ASTNode> parse() {
+        auto root = make<ObjectNode>();
+        root->useArena(state.arena);
+        if (shape) root->reserve(shape->topLevel);
+        parseEntries([&root](const Symbol& key, NodeRef<ASTNode> value) {
+            root->appendProperty(key, move(value));
+        });
+        root->sortProperties();
+        return root;
+    }
+
+    // Разбирает вход, передавая каждую готовую запись верхнего уровня в onEntry
+    // сразу после её разбора, в порядке следования в исходном тексте
+    void parseEntries(const function<void(const Symbol&, NodeRef<ASTNode>)>& onEntry) {
+        while (currentToken.type != TokenType::EOF_TOKEN) {
+            if (currentToken.type == TokenType::GLOBAL) {
+                eat(TokenType::GLOBAL);
+                // место под значение заводится до разбора, чтобы не копировать имя;
+                // пустое значение до конца разбора означает, что константа ещё не определена
+                NodeRef<ASTNode>* slot = nullptr;
+                if (currentToken.type == TokenType::IDENTIFIER) slot = &state.constants[tokenText()];
+                eat(TokenType::IDENTIFIER);
+                eat(TokenType::EQUALS);
+                inConstant = true;
+                size_t start = lexer.consumed();
+                auto value = spillIfLarge(parseValue(), start);
+                inConstant = false;
+                *slot = value;
+            }
+            else if (currentToken.type == TokenType::IDENTIFIER) {
+                const Symbol& key = state.symbols->intern(tokenText());
+                eat(TokenType::IDENTIFIER);
+                eat(TokenType::EQUALS);
+                if (!streamedArrayPaths.empty()) currentPath = key.name;
+                size_t start = lexer.consumed();
+                auto value = spillIfLarge(parseValue(), start);
+                onEntry(key, value);
+            }
+            else if (currentToken.type == TokenType::LBRACE) {
+                if (!streamedArrayPaths.empty()) currentPath = "unnamed";
+                size_t start = lexer.consumed();
+                auto obj = spillIfLarge(parseObject(), start);
+                onEntry(state.symbols->intern("unnamed"), obj);
+            }
+            else {
+                throw runtime_error("Неожиданный токен: " + currentToken.text() + " в строке " + to_string(currentToken.line));
+            }
+        }
+    }
+};
+
+string StreamedArrayNode::toJSON(int indent) const {
+    Lexer lexer(text, length, start, line, column);
+    Parser parser(lexer, constants);
+    string result = "[";
+    bool first = true;
+    while (auto element = parser.nextArrayElement()) {
+        if (!first) result += ", ";
+        result += element->toJSON();
+        first = false;
+    }
+    result += "]";
+    return result;
+}
+
+JsonSize StreamedArrayNode::jsonSize() const {
+    if (!sizeKnown) {
+        Lexer lexer(text, length, start, line, column);
+        Parser parser(lexer, constants);
+        size_t base = count == 0 ? 2 : 2 * count;
+        while (auto element = parser.nextArrayElement()) {
+            base += element->jsonSize().base;
+        }
+        cachedSize = { base, 0 };
+        sizeKnown = true;
+    }
+    return cachedSize;
+}
+
+char* StreamedArrayNode::writeJSON(char* out, int indent) const {
+    Lexer lexer(text, length, start, line, column);
+    Parser parser(lexer, constants);
+    *out++ = '[';
+    bool first = true;
+    while (auto element = parser.nextArrayElement()) {
+        if (!first) out = writeBytes(out, ", ", 2);
+        out = element->writeJSON(out);
+        first = false;
+    }
+    *out++ = ']';
+    return out;
+}
+
+void StreamedArrayNode::emit(Emitter& emitter) const {
+    Lexer lexer(text, length, start, line, column);
+    Parser parser(lexer, constants);
+    emitter.beginArray(count);
+    while (auto element = parser.nextArrayElement()) {
+        element->emit(emitter);
+    }
+    emitter.endArray();
+}
+
+// Многоразовое преобразование текста в JSON. Арена узлов, таблица констант, буфер текста
+// токенов и выходная строка остаются между вызовами, поэтому после первых запусков на
+// похожих конфигурациях convert() не обращается к куче. Память ещё выделяется под новые
+// имена ключей и констант и под числа длиннее 15 шестнадцатеричных цифр
+class Converter {
+    NodeArena arena;
+    SymbolTable symbols;
+    ParseState state;
+    string output;
+    ConversionLimits limits;
+
+    // Между вызовами деревьев нет, поэтому разросшуюся таблицу ключей можно сбросить
+    void release() {
+        state.reset();
+        arena.reset();
+        if (symbols.size() > 4096) symbols.clear();
+    }
+
+public:
+    Converter() {
+        state.arena = &arena;
+        state.symbols = &symbols;
+    }
+
+    // Ограничения для следующих вызовов convert()
+    void limit(const ConversionLimits& bounds) { limits = bounds; }
+
+    // JSON для текста [text, text + size); строка действительна до следующего вызова.
+    // С cancellation разбор прерывается при отмене или по сроку, а вывод — перед записью
+    const string& convert(const char* text, size_t size, const CancellationToken* cancellation = nullptr) {
+        try {
+            Lexer lexer(text, size);
+            lexer.cancelWith(cancellation);
+            Parser parser(lexer, state);
+            parser.limit(limits);
+            NodeRef<ASTNode> root = parser.parse();
+            size_t bytes = root->jsonSize().at(0);
+            limits.checkOutput(bytes);
+            if (cancellation) cancellation->check();
+            output.resize(bytes);
+            root->writeJSON(&output[0]);
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+        release();
+        return output;
+    }
+    const string& convert(const string& text) {
+        return convert(text.data(), text.size());
+    }
+
+    size_t arenaCapacity() const { return arena.capacity(); }
+};
+
+// Вывод записей верхнего уровня по мере их разбора. Запись сериализуется в отдельном потоке,
+// пока парсер разбирает следующие, и сразу сбрасывается в выход. Ключи идут в порядке
+// исходного текста, поэтому повтор ключа верхнего уровня считается ошибкой.
+// Записи разделяют узлы с константами парсера, а счётчики ссылок не атомарные, поэтому поток
+// вывода только читает запись и возвращает её в written: освобождает её поток парсера
+class EntryWriter {
+    Emitter& emitter;
+    deque<pair<const Symbol*, NodeRef<ASTNode>>> queue;
+    vector<NodeRef<ASTNode>> written;
+    set<const Symbol*> seenKeys;
+    size_t capacity;
+    bool closed = false;
+    bool aborted = false;
+    exception_ptr failure;
+    mutex lock;
+    condition_variable changed;
+    thread worker;
+
+    void run() {
+        try {
+            emitter.beginObject(unknownSize);
+            while (true) {
+                const Symbol* key;
+                const ASTNode* value;
+                {
+                    unique_lock<mutex> guard(lock);
+                    changed.wait(guard, [this] { return closed || !queue.empty(); });
+                    // при ошибке разбора объект не закрывается, чтобы обрыв был заметен
+                    if (aborted) return;
+                    if (queue.empty()) break;
+                    // ссылки на элементы deque не меняются при добавлении в конец
+                    key = queue.front().first;
+                    value = queue.front().second.get();
+                }
+                emitter.key(*key);
+                value->emit(emitter);
+                emitter.flush();
+                {
+                    unique_lock<mutex> guard(lock);
+                    written.push_back(move(queue.front().second));
+                    queue.pop_front();
+                }
+                changed.notify_all();
+            }
+            emitter.endObject();
+            emitter.flush();
+        }
+        catch (...) {
+            unique_lock<mutex> guard(lock);
+            failure = current_exception();
+            closed = true;
+            changed.notify_all();
+        }
+    }
+
+public:
+    EntryWriter(Emitter& target, size_t maxQueued = 64)
+        : emitter(target), capacity(maxQueued > 0 ? maxQueued : 1) {
+        worker = thread(&EntryWriter::run, this);
+    }
+
+    ~EntryWriter() {
+        {
+            unique_lock<mutex> guard(lock);
+            if (!closed) aborted = true;
+            closed = true;
+        }
+        changed.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    void add(const Symbol& key, NodeRef<ASTNode> value) {
+        if (!seenKeys.insert(&key).second) {
+            throw runtime_error("Повторяющийся ключ верхнего уровня при потоковом выводе: " + key.name);
+        }
+        // выведенные записи освобождаются здесь, в потоке парсера, уже без блокировки
+        vector<NodeRef<ASTNode>> released;
+        unique_lock<mutex> guard(lock);
+        // очередь ограничена, чтобы быстрый парсер не накапливал всё дерево в памяти
+        changed.wait(guard, [this] { return closed || queue.size() < capacity; });
+        if (failure) rethrow_exception(failure);
+        queue.emplace_back(&key, move(value));
+        released.swap(written);
+        guard.unlock();
+        changed.notify_all();
+    }
+
+    // Дожидается вывода всех записей и закрывает объект верхнего уровня
+    void finish() {
+        {
+            unique_lock<mutex> guard(lock);
+            closed = true;
+        }
+        changed.notify_all();
+        if (worker.joinable()) worker.join();
+        if (failure) rethrow_exception(failure);
+    }
+};
+
+// Готовое дерево в неизменяемом виде, которое можно разделять между потоками: копия FrozenTree
+// разделяет корень, а читатели получают только const ASTNode& и не трогают счётчики узлов.
+// При заморозке заранее вычисляются размеры JSON, так что параллельные писатели лишь читают
+// их кэш. Замораживать можно только дерево, разбор которого закончен
+class FrozenTree {
+    struct Holder {
+        NodeRef<ASTNode> root;
+    };
+    shared_ptr<const Holder> holder;
+
+public:
+    explicit FrozenTree(NodeRef<ASTNode> root) {
+        root->jsonSize();
+        holder = make_shared<const Holder>(Holder{ move(root) });
+    }
+
+    const ASTNode& root() const { return *holder->root; }
+};
+
+// Пишет JSON прямо в отображённый в память файл. Размер известен заранее из jsonSize(),
+// поэтому файл сразу получает окончательную длину, а свойства корня заполняются параллельно
+// в непересекающихся диапазонах. Буфер ofstream и промежуточная строка не нужны
+void writeMappedJSON(const ASTNode& root, const string& path, unsigned threads) {
+    size_t total = root.jsonSize().at(0);
+    auto fill = [&](char* out) {
+        if (auto object = dynamic_cast<const ObjectNode*>(&root)) object->writeJSONParallel(out, threads);
+        else root.writeJSON(out);
+    };
+#ifdef _WIN32
+    // без mmap: тот же точный буфер, записанный одним вызовом
+    string buffer(total, '\0');
+    fill(&buffer[0]);
+    ofstream outFile(path, ios::binary);
+    if (!outFile) {
+        throw runtime_error("Не удается открыть выходной файл: " + path);
+    }
+    outFile.write(buffer.data(), buffer.size());
+#else
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw runtime_error("Не удается открыть выходной файл: " + path);
+    }
+    if (ftruncate(fd, static_cast<off_t>(total)) != 0) {
+        close(fd);
+        throw runtime_error("Не удается задать размер выходного файла: " + path);
+    }
+    void* mapping = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        throw runtime_error("Не удается отобразить выходной файл в память: " + path);
+    }
+    try {
+        fill(static_cast<char*>(mapping));
+    }
+    catch (...) {
+        munmap(mapping, total);
+        close(fd);
+        throw;
+    }
+    munmap(mapping, total);
+    close(fd);
+#endif
+}
+
+// Параллельная сериализация: большие объекты и массивы делятся на куски соседних элементов,
+// каждый кусок пишется отдельным потоком в свой буфер, а структурные байты между ними
+// (скобки, разделители, отступы) — небольшими фрагментами. Порядок фрагментов фиксирован,
+// поэтому результат совпадает с последовательным выводом байт в байт
+class ParallelJsonWriter {
+    struct Item {
+        const Symbol* key;
+        const ASTNode* value;
+    };
+    struct Chunk {
+        size_t piece;
+        vector<Item> items;
+        int indent;
+        bool members;
+        bool leadingSeparator;
+    };
+
+    unsigned threads;
+    size_t target;
+    vector<string> pieces;
+    vector<bool> isChunkPiece;
+    vector<Chunk> chunks;
+
+    // структурные байты дописываются к предыдущему фрагменту, если он не заполняется потоком
+    void literal(const string& text) {
+        if (!pieces.empty() && !isChunkPiece.back()) {
+            pieces.back() += text;
+            return;
+        }
+        pieces.push_back(text);
+        isChunkPiece.push_back(false);
+    }
+
+    static size_t itemSize(const Item& item, const Chunk& chunk) {
+        if (chunk.members) return chunk.indent + 2 + item.key->json.size() + item.value->jsonSize().at(chunk.indent + 2);
+        return item.value->jsonSize().at(chunk.indent);
+    }
+
+    void flushChunk(Chunk& pending) {
+        if (pending.items.empty()) return;
+        pending.piece = pieces.size();
+        pieces.emplace_back();
+        isChunkPiece.push_back(true);
+        chunks.push_back(move(pending));
+        pending.items.clear();
+    }
+
+    static bool splittable(const ASTNode& node) {
+        auto object = dynamic_cast<const ObjectNode*>(&node);
+        if (object) return object->getProperties().size() > 1;
+        auto array = dynamic_cast<const ArrayNode*>(&node);
+        return array && array->getElements().size() > 1;
+    }
+
+    void plan(const ASTNode& node, int indent) {
+        if (node.jsonSize().at(indent) <= target || !splittable(node)) {
+            Chunk whole{ 0, { Item{ nullptr, &node } }, indent, false, false };
+            flushChunk(whole);
+            return;
+        }
+        Chunk pending{ 0, {}, indent, false, false };
+        size_t pendingBytes = 0;
+        bool first = true;
+        if (auto object = dynamic_cast<const ObjectNode*>(&node)) {
+            literal("{\n");
+            pending.members = true;
+            for (const auto& prop : object->getProperties()) {
+                Item item{ prop.first, prop.second.get() };
+                size_t size = itemSize(item, pending);
+                if (size > target && splittable(*prop.second)) {
+                    flushChunk(pending);
+                    literal((first ? "" : ",\n") + string(indent + 2, ' ') + prop.first->json);
+                    plan(*prop.second, indent + 2);
+                }
+                else {
+                    if (pending.items.empty()) {
+                        pending.leadingSeparator = !first;
+                        pendingBytes = 0;
+                    }
+                    pending.items.push_back(item);
+                    pendingBytes += size;
+                    if (pendingBytes >= target) flushChunk(pending);
+                }
+                first = false;
+            }
+            flushChunk(pending);
+            literal("\n" + string(indent, ' ') + "}");
+        }
+        else {
+            auto& array = dynamic_cast<const ArrayNode&>(node);
+            // элементы массива всегда выводятся с нулевым отступом
+            pending.indent = 0;
+            literal("[");
+            for (const auto& element : array.getElements()) {
+                Item item{ nullptr, element.get() };
+                size_t size = itemSize(item, pending);
+                if (size > target && splittable(*element)) {
+                    flushChunk(pending);
+                    if (!first) literal(", ");
+                    plan(*element, 0);
+                }
+                else {
+                    if (pending.items.empty()) {
+                        pending.leadingSeparator = !first;
+                        pendingBytes = 0;
+                    }
+                    pending.items.push_back(item);
+                    pendingBytes += size;
+                    if (pendingBytes >= target) flushChunk(pending);
+                }
+                first = false;
+            }
+            flushChunk(pending);
+            literal("]");
+        }
+    }
+
+    void fill(Chunk& chunk) {
+        size_t size = 2 * (chunk.items.size() - 1 + (chunk.leadingSeparator ? 1 : 0));
+        for (const auto& item : chunk.items) size += itemSize(item, chunk);
+        string& buffer = pieces[chunk.piece];
+        buffer.resize(size);
+        char* out = &buffer[0];
+        bool first = !chunk.leadingSeparator;
+        for (const auto& item : chunk.items) {
+            if (!first) out = writeBytes(out, chunk.members ? ",\n" : ", ", 2);
+            first = false;
+            if (chunk.members) {
+                memset(out, ' ', chunk.indent + 2);
+                out += chunk.indent + 2;
+                out = writeBytes(out, item.key->json.data(), item.key->json.size());
+                out = item.value->writeJSON(out, chunk.indent + 2);
+            }
+            else {
+                out = item.value->writeJSON(out, chunk.indent);
+            }
+        }
+    }
+
+public:
+    ParallelJsonWriter(unsigned workerCount, size_t minChunk = 64 * 1024)
+        : threads(max(1u, workerCount)), target(minChunk) {
+    }
+
+    // Сериализует дерево во фрагменты, которые нужно вывести подряд
+    const vector<string>& serialize(const ASTNode& root) {
+        pieces.clear();
+        isChunkPiece.clear();
+        chunks.clear();
+        // размеры считаются заранее в этом потоке: дальше узлы только читаются
+        size_t total = root.jsonSize().at(0);
+        target = max(target, total / (threads * 8 + 1));
+        plan(root, 0);
+        parallelFor(chunks.size(), threads, [this](size_t i) { fill(chunks[i]); });
+        return pieces;
+    }
+};
+
+int openOutputDescriptor(const string& path) {
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        throw runtime_error("Не удается открыть выходной файл: " + path);
+    }
+    return fd;
+}
+
+// Выходной файл, открытый как дескриптор и закрываемый при уничтожении
+class OutputFile {
+    int fd;
+public:
+    explicit OutputFile(const string& path) : fd(openOutputDescriptor(path)) {}
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+    ~OutputFile() { closeDescriptor(fd); }
+    int descriptor() const { return fd; }
+};
+
+// Выводит фрагменты подряд одним системным вызовом на пачку (writev)
+void writeGathered(int fd, const vector<string>& pieces) {
+    vector<ByteRange> ranges;
+    for (const auto& piece : pieces) ranges.push_back({ piece.data(), piece.size() });
+    writeRanges(fd, move(ranges));
+}
+
+// Пакетное преобразование файлов в JSON. Стоимость задания оценивается по размеру входа (stat),
+// и освободившийся поток берёт самое дешёвое задание из очереди, так что мелкие конфигурации
+// не ждут за огромными. При нескольких потоках первый поток берёт только задания меньше
+// largeJob: даже если очередь забита огромными файлами, для мелких всегда остаётся свободный поток.
+// Каждое задание имеет свой CancellationToken; срок отсчитывается от постановки в очередь,
+// и задание с истёкшим сроком снимается, не начавшись. Запущенное задание ограничено ещё и
+// временем работы и ConversionLimits (см. limit()): лексер и вывод проверяют отмену по ходу работы,
+// так что зависшее или злонамеренное задание не держит поток дольше своего бюджета
+class BatchScheduler {
+public:
+    enum class Status { queued, running, done, failed, cancelled };
+    struct Job {
+        string input;
+        string output;
+        uint64_t cost = 0;
+        CancellationToken cancellation;
+        chrono::steady_clock::time_point submitted;
+        Status status = Status::queued;
+        string error;
+        double latency = 0;      // мс от постановки в очередь до завершения
+        size_t finishedAs = 0;   // порядковый номер завершения
+    };
+
+private:
+    unsigned threads;
+    uint64_t largeJob;
+    chrono::milliseconds timeout;
+    chrono::milliseconds runTime = chrono::milliseconds(0);
+    ConversionLimits limits;
+    deque<Job> jobs;
+    vector<Job*> queue;          // куча по стоимости: сверху самое дешёвое
+    size_t finished = 0;
+    bool closing = false;
+    mutex lock;
+    condition_variable ready;
+    vector<thread> workers;
+
+    static bool costlier(const Job* a, const Job* b) {
+        return a->cost != b->cost ? a->cost > b->cost : a->submitted > b->submitted;
+    }
+    bool eligible(bool smallOnly) const {
+        return !queue.empty() && (!smallOnly || queue.front()->cost < largeJob);
+    }
+
+    void run(bool smallOnly) {
+        Converter converter;
+        converter.limit(limits);
+        while (true) {
+            Job* job;
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [&] { return closing || eligible(smallOnly); });
+                if (!eligible(smallOnly)) return;
+                pop_heap(queue.begin(), queue.end(), costlier);
+                job = queue.back();
+                queue.pop_back();
+                job->status = Status::running;
+                if (runTime.count() > 0) job->cancellation.expireAt(chrono::steady_clock::now() + runTime);
+            }
+            Status status = Status::done;
+            string error;
+            try {
+                job->cancellation.check();
+                InputFile input(job->input);
+                const string& json = converter.convert(input.data(), input.size(), &job->cancellation);
+                // запись — последняя точка, где задание ещё можно прервать без частичного выхода
+                job->cancellation.check();
+                OutputFile output(job->output);
+                writeRanges(output.descriptor(), vector<ByteRange>(1, ByteRange{ json.data(), json.size() }));
+            }
+            catch (const ConversionCancelled& e) {
+                status = Status::cancelled;
+                error = e.what();
+            }
+            catch (const exception& e) {
+                status = Status::failed;
+                error = e.what();
+            }
+            lock_guard<mutex> guard(lock);
+            job->status = status;
+            job->error = error;
+            job->latency = chrono::duration<double, milli>(chrono::steady_clock::now() - job->submitted).count();
+            job->finishedAs = finished++;
+        }
+    }
+
+public:
+    // timeout 0 — без срока
+    BatchScheduler(unsigned threadCount, uint64_t largeJobBytes = 16 * 1024 * 1024,
+        chrono::milliseconds jobTimeout = chrono::milliseconds(0))
+        : threads(max(1u, threadCount)), largeJob(largeJobBytes), timeout(jobTimeout) {
+    }
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+    ~BatchScheduler() { finish(); }
+
+    // Ставит задания в очередь разом, так что их порядок определяется только стоимостью.
+    // Возвращает номер первого; задания можно добавлять и после start()
+    size_t submit(const vector<pair<string, string>>& paths) {
+        lock_guard<mutex> guard(lock);
+        size_t first = jobs.size();
+        auto now = chrono::steady_clock::now();
+        for (const auto& path : paths) {
+            jobs.emplace_back();
+            Job& job = jobs.back();
+            job.input = path.first;
+            job.output = path.second;
+            struct stat info;
+            if (stat(path.first.c_str(), &info) == 0) job.cost = static_cast<uint64_t>(info.st_size);
+            job.submitted = now;
+            if (timeout.count() > 0) job.cancellation.expireAt(now + timeout);
+            queue.push_back(&job);
+            push_heap(queue.begin(), queue.end(), costlier);
+        }
+        ready.notify_all();
+        return first;
+    }
+    void cancel(size_t id) {
+        lock_guard<mutex> guard(lock);
+        jobs[id].cancellation.cancel();
+    }
+    // Ограничения каждого задания и время его работы (0 — без ограничения); вызывать до start()
+    void limit(const ConversionLimits& bounds, chrono::milliseconds runLimit) {
+        limits = bounds;
+        runTime = runLimit;
+    }
+
+    // Если поток не создаётся, уже запущенные останавливаются и присоединяются до исключения:
+    // разрушение присоединяемого std::thread вызвало бы terminate. Задания из очереди отменяются
+    void start() {
+        unique_lock<mutex> guard(lock);
+        if (!workers.empty() || closing) return;
+        try {
+            for (unsigned i = 0; i < threads; ++i) {
+                workers.emplace_back(&BatchScheduler::run, this, threads > 1 && i == 0);
+            }
+        }
+        catch (const system_error& e) {
+            closing = true;
+            for (Job* job : queue) {
+                job->status = Status::cancelled;
+                job->error = "пакет остановлен";
+            }
+            queue.clear();
+            guard.unlock();
+            ready.notify_all();
+            for (auto& worker : workers) worker.join();
+            workers.clear();
+            throw runtime_error("Не удается запустить поток пакета (" + to_string(threads) + " потоков): " + e.what());
+        }
+    }
+    // Дожидается всех заданий и останавливает потоки
+    void finish() {
+        start();
+        {
+            lock_guard<mutex> guard(lock);
+            closing = true;
+        }
+        ready.notify_all();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    size_t size() const { return jobs.size(); }
+    const Job& job(size_t id) const { return jobs[id]; }
+    uint64_t largeJobBytes() const { return largeJob; }
+};
+
+// Итог пакета: число заданий по исходу и задержки (ожидание в очереди + работа)
+// отдельно для мелких и крупных заданий
+void printBatchSummary(ostream& out, const BatchScheduler& batch) {
+    size_t counts[5] = { 0, 0, 0, 0, 0 };
+    vector<double> latencies[2];
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const BatchScheduler::Job& job = batch.job(i);
+        counts[static_cast<int>(job.status)]++;
+        if (job.status == BatchScheduler::Status::done) {
+            latencies[job.cost >= batch.largeJobBytes() ? 1 : 0].push_back(job.latency);
+        }
+    }
+    out << "Заданий: " << batch.size() << ", выполнено " << counts[2] << ", с ошибкой " << counts[3]
+        << ", отменено " << counts[4] << "\n";
+    static const char* const groups[] = { "мелкие", "крупные" };
+    for (int group = 0; group < 2; ++group) {
+        vector<double>& values = latencies[group];
+        if (values.empty()) continue;
+        sort(values.begin(), values.end());
+        auto percentile = [&](double p) { return values[min(values.size() - 1, static_cast<size_t>(p * values.size()))]; };
+        out << "  " << groups[group] << " (" << values.size() << "): p50 " << fixed << setprecision(1)
+            << percentile(0.5) << " мс, p99 " << percentile(0.99) << " мс, максимум " << values.back() << " мс\n";
+    }
+}
+
+// Генератор случайных конфигураций для дифференциальной проверки. Ключи чаще берутся
+// из маленького набора, чтобы встречались повторы и пути потоковых массивов
+class ConfigGenerator {
+    mt19937 random;
+    vector<string> constants;
+
+    size_t pick(size_t count) { return random() % count; }
+
+    string space() {
+        static const char* const blanks[] = { " ", " ", "\n", "\t", "  ", "\r\n", "\v", "\f" };
+        string result = blanks[pick(8)];
+        // длинные серии, чтобы работали векторные ветки ядер
+        if (pick(20) == 0) result.append(20 + pick(60), pick(2) ? ' ' : '\n');
+        return result;
+    }
+
+    string identifier() {
+        static const char* const common[] = { "a", "b", "c", "list", "name" };
+        if (pick(3) > 0) return common[pick(5)];
+        static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        static const char tail[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+        string result(1, letters[pick(sizeof(letters) - 1)]);
+        size_t length = pick(10) == 0 ? 40 + pick(40) : pick(6);
+        for (size_t i = 0; i < length; ++i) result += tail[pick(sizeof(tail) - 1)];
+        if (result == "global" || result == "true" || result == "false") result += "_";
+        return result;
+    }
+
+    string number() {
+        static const char digits[] = "0123456789abcdefABCDEF";
+        string result = pick(2) ? "0x" : "0X";
+        size_t length = 1 + (pick(10) == 0 ? 10 + pick(5) : pick(4));
+        for (size_t i = 0; i < length; ++i) result += digits[pick(sizeof(digits) - 1)];
+        return result;
+    }
+
+    string stringLiteral() {
+        if (pick(10) == 0) return pick(2) ? "\"true\"" : "\"false\"";
+        static const char* const pieces[] = { "a", "Z", " ", "\n", "\\", "\t", "\x01", "\xc3\xa9", "/usr/share", "9", "{", "#(" };
+        string result = "\"";
+        size_t count = pick(8) == 0 ? 30 + pick(60) : pick(6);
+        for (size_t i = 0; i < count; ++i) result += pieces[pick(12)];
+        return result + "\"";
+    }
+
+    string value(int depth) {
+        switch (pick(depth >= 3 ? 4 : 6)) {
+        case 0: return number();
+        case 1: return stringLiteral();
+        case 2: return pick(2) ? "true" : "false";
+        case 3:
+            if (constants.empty()) return number();
+            return "?[" + constants[pick(constants.size())] + "]";
+        case 4: {
+            string result = "#(" + space();
+            size_t count = pick(8) == 0 ? 10 + pick(20) : pick(5);
+            for (size_t i = 0; i < count; ++i) result += value(depth + 1) + space();
+            return result + ")";
+        }
+        default:
+            return object(depth + 1);
+        }
+    }
+
+    string object(int depth) {
+        string result = "{" + space();
+        size_t count = pick(10) == 0 ? 9 + pick(10) : pick(5);
+        for (size_t i = 0; i < count; ++i) {
+            result += identifier() + space() + "=" + space() + value(depth) + space();
+        }
+        return result + "}";
+    }
+
+public:
+    explicit ConfigGenerator(uint32_t seed) : random(seed) {}
+
+    string config() {
+        constants.clear();
+        string text = pick(2) ? "" : space();
+        size_t count = 1 + pick(6);
+        for (size_t i = 0; i < count; ++i) {
+            size_t kind = pick(6);
+            if (kind == 0) {
+                string name = identifier();
+                text += "global " + name + space() + "=" + space() + value(1) + "\n";
+                constants.push_back(name);
+            }
+            else if (kind == 1) {
+                text += object(1) + space();
+            }
+            else {
+                text += identifier() + space() + "=" + space() + value(0) + space();
+            }
+        }
+        return text;
+    }
+
+    // Порча корректного текста: удаление, вставка или замена символа, обрезка
+    string mutate(string text) {
+        static const char noise[] = "{}()[]#=?\"x0 \n_global";
+        size_t edits = 1 + pick(3);
+        for (size_t i = 0; i < edits && !text.empty(); ++i) {
+            size_t at = pick(text.size());
+            switch (pick(5)) {
+            case 0: text.erase(at, 1); break;
+            case 1: text.insert(at, 1, noise[pick(sizeof(noise) - 1)]); break;
+            case 2: text[at] = noise[pick(sizeof(noise) - 1)]; break;
+            case 3: text.resize(at); break;
+            default: text.insert(at, 1, pick(4) == 0 ? '\0' : '@'); break;
+            }
+        }
+        return text;
+    }
+};
+
+// Результат движка в сравнимом виде: "ok " + JSON или "error " + текст исключения
+string engineOutcome(const function<string()>& run) {
+    try {
+        return "ok " + run();
+    }
+    catch (const exception& e) {
+        return string("error ") + e.what();
+    }
+}
+
+string emitToString(const ASTNode& root, size_t bufferSize = 64 * 1024) {
+    ostringstream out;
+    {
+        OutputSink sink(out, bufferSize);
+        JsonEmitter emitter(sink);
+        root.emit(emitter);
+    }
+    return out.str();
+}
+
+// Все способы разбора и вывода JSON, которые должны совпадать с эталоном
+// Lexer(string) + Parser::parse() + toJSON() байт в байт, включая тексты ошибок.
+// Потоковый вывод записей (--stream-output) не сравнивается: он по построению
+// сохраняет порядок исходного текста и запрещает повтор ключей верхнего уровня
+vector<pair<string, function<string(const string&)>>> differentialEngines() {
+    vector<pair<string, function<string(const string&)>>> engines;
+    engines.emplace_back("буфер без копии + JsonEmitter", [](const string& text) {
+        Lexer lexer(text.data(), text.size());
+        return emitToString(*Parser(lexer).parse(), 7);
+    });
+    // один Converter на все итерации: каждый разбор получает арену и константы от предыдущего
+    auto converter = make_shared<Converter>();
+    engines.emplace_back("многоразовый Converter", [converter](const string& text) {
+        return converter->convert(text);
+    });
+    // порог в 1 байт: выгружается каждый объект и массив, вложенные выгрузки идут ссылками
+    engines.emplace_back("выгрузка поддеревьев", [](const string& text) {
+        SpillFile spill(temporaryDirectory(), 1);
+        Lexer lexer(text.data(), text.size());
+        Parser parser(lexer);
+        parser.spillTo(spill);
+        return emitToString(*parser.parse());
+    });
+    engines.emplace_back("потоковый лексер", [](const string& text) {
+        istringstream in(text);
+        StreamSource source(in);
+        Lexer lexer(source, 1 + text.size() % 13);
+        return emitToString(*Parser(lexer).parse());
+    });
+    engines.emplace_back("предварительный подсчёт", [](const string& text) {
+        InputShape shape = countShape(text.data(), text.size());
+        Lexer lexer(text.data(), text.size());
+        Parser parser(lexer);
+        parser.presize(shape);
+        return parser.parse()->toJSON();
+    });
+    engines.emplace_back("пул строк", [](const string& text) {
+        StringPool pool;
+        Lexer lexer(text.data(), text.size());
+        Parser parser(lexer);
+        parser.internStrings(pool);
+        return emitToString(*parser.parse());
+    });
+    engines.emplace_back("потоковые массивы", [](const string& text) {
+        Lexer lexer(text.data(), text.size());
+        Parser parser(lexer);
+        const char* const paths[] = { "a", "b", "list", "a.b", "c.list", "name.a" };
+        for (const char* path : paths) parser.streamArrayAt(path);
+        auto root = parser.parse();
+        string emitted = emitToString(*root);
+        if (root->toJSON() != emitted) throw runtime_error("toJSON() и emit() потоковых массивов расходятся");
+        return emitted;
+    });
+    engines.emplace_back("точный размер + writeJSON", [](const string& text) {
+        Lexer lexer(text.data(), text.size());
+        FrozenTree tree(Parser(lexer).parse());
+        string buffer(tree.root().jsonSize().at(0), '\0');
+        char* end = tree.root().writeJSON(&buffer[0]);
+        if (end != &buffer[0] + buffer.size()) throw runtime_error("writeJSON() не совпал с jsonSize()");
+        string parallel(buffer.size(), '\0');
+        dynamic_cast<const ObjectNode&>(tree.root()).writeJSONParallel(&parallel[0], 3);
+        if (parallel != buffer) throw runtime_error("writeJSONParallel() расходится с writeJSON()");
+        return buffer;
+    });
+    engines.emplace_back("ParallelJsonWriter", [](const string& text) {
+        Lexer lexer(text.data(), text.size());
+        FrozenTree tree(Parser(lexer).parse());
+        ParallelJsonWriter writer(3, 1);
+        string joined;
+        for (const auto& piece : writer.serialize(tree.root())) joined += piece;
+        return joined;
+    });
+    for (const char* level : kernelLevels) {
+        if (!cpuSupports(level)) continue;
+        string name = string("ядра ") + level;
+        string chosen = level;
+        engines.emplace_back(name, [chosen](const string& text) {
+            TextKernels saved = textKernels;
+            selectKernels(chosen);
+            try {
+                Lexer lexer(text.data(), text.size());
+                string result = emitToString(*Parser(lexer).parse());
+                textKernels = saved;
+                return result;
+            }
+            catch (...) {
+                textKernels = saved;
+                throw;
+            }
+        });
+    }
+    return engines;
+}
+
+// Прогоняет iterations случайных конфигураций (каждая третья испорчена) через все движки.
+// Возвращает число расхождений; первые из них с входным текстом пишутся в log
+size_t runDifferentialFuzz(size_t iterations, uint32_t seed, ostream& log) {
+    ConfigGenerator generator(seed);
+    auto engines = differentialEngines();
+    size_t mismatches = 0;
+    size_t errors = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        string text = generator.config();
+        if (i % 3 == 2) text = generator.mutate(text);
+        string expected = engineOutcome([&text]() {
+            Lexer lexer(text);
+            return Parser(lexer).parse()->toJSON();
+        });
+        if (expected.compare(0, 6, "error ") == 0) errors++;
+        for (const auto& engine : engines) {
+            string actual = engineOutcome([&]() { return engine.second(text); });
+            if (actual == expected) continue;
+            if (++mismatches <= 3) {
+                log << "Расхождение (итерация " << i << ", seed " << seed << ", движок: " << engine.first << ")\n"
+                    << "--- вход ---\n" << text << "\n--- ожидалось ---\n" << expected
+                    << "\n--- получено ---\n" << actual << "\n";
+            }
+        }
+    }
+    log << "Проверено конфигураций: " << iterations << " (с ошибкой разбора: " << errors << "), движков: "
+        << engines.size() << ", расхождений: " << mismatches << "\n";
+    return mismatches;
+}
+
+// Счётчик обращений к куче через operator new — по нему тест 26 проверяет, что Converter
+// после прогрева работает без выделений памяти. Замена глобального operator new добавляет
+// атомарную операцию к каждому выделению, поэтому собирается только для тестов:
+// g++ -DCLT_COUNT_ALLOCATIONS ...
+#ifdef CLT_COUNT_ALLOCATIONS
+atomic<size_t> heapAllocations(0);
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    while (true) {
+        if (void* memory = malloc(size > 0 ? size : 1)) return memory;
+        new_handler handler = get_new_handler();
+        if (!handler) throw bad_alloc();
+        handler();
+    }
+}
+
+// GCC видит free() после встраивания в delete-выражения и ошибочно считает пару new/delete несогласованной
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+// Возвращает число не пройденных тестов
+int runTests() {
+    cout << "Выполнение тестов...\n";
+    int failures = 0;
+
+    // Тест 1: Простое число
+    {
+        Lexer lexer("port = 0x1A");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 1 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 1 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 2: Массив
+    {
+        Lexer lexer("ports = #( 0x01 0x02 0x03 )");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 2 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 2 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 3: Константы
+    {
+        Lexer lexer("global MAX_SIZE = 0x100\nsize = ?[MAX_SIZE]");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 3 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 3 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 4: Объект
+    {
+        Lexer lexer("config = { timeout = 0x1E enabled = true }");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 4 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 4 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 5: Комплексный пример
+    {
+        Lexer lexer("global PORT = 0x50\nserver = { port = ?[PORT] hosts = #( \"host1\" \"host2\" ) }");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 5 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 5 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 6: Вложенные объекты
+    {
+        Lexer lexer("app = { database = { host = \"localhost\" port = 0x2276 } }");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 6 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 6 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 7: Смешанные типы данных
+    {
+        Lexer lexer("settings = { numbers = #( 0x01 0x02 ) strings = #( \"a\" \"b\" ) flag = true }");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 7 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 7 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 8: Множественные константы
+    {
+        Lexer lexer("global WIDTH = 0x500\nglobal HEIGHT = 0x300\ndimensions = { width = ?[WIDTH] height = ?[HEIGHT] }");
+        Parser parser(lexer);
+        try {
+            auto result = parser.parse();
+            cout << "Тест 8 пройден: " << result->toJSON() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 8 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 9: Потоковый лексер с блоками по одному байту совпадает с обычным разбором
+    {
+        string text = "global PORT = 0x50\nserver = { port = ?[PORT] hosts = #( \"host1\" \"host2\" ) list = #( { a = 0x1 } ) }";
+        try {
+            Lexer lexer(text);
+            Parser parser(lexer);
+            string expected = parser.parse()->toJSON();
+
+            istringstream in(text);
+            StreamSource source(in);
+            Lexer streamLexer(source, 1);
+            Parser streamParser(streamLexer);
+            ostringstream out;
+            {
+                OutputSink sink(out, 16);
+                JsonEmitter emitter(sink);
+                streamParser.parse()->emit(emitter);
+            }
+            if (out.str() != expected) {
+                throw runtime_error("вывод отличается от toJSON(): " + out.str());
             }
+            cout << "Тест 9 пройден: " << out.str() << endl;
         }
-        else if (currentToken.type == TokenType::HASH) {
-            eat(TokenType::HASH);
-            eat(TokenType::LPAREN);
-            auto array = make_shared<ArrayNode>();
-            while (currentToken.type != TokenType::RPAREN && currentToken.type != TokenType::EOF_TOKEN) {
-                array->addElement(parseValue());
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 9 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 10: Потоковый массив по пути выводится так же, как обычный
+    {
+        string text = "global STEP = 0x10\ntelemetry = { buckets = #( 0x01 ?[STEP] #( 0x02 ) { a = \"b\" } ) }\nglobal STEP = 0x20";
+        try {
+            Lexer lexer(text);
+            Parser parser(lexer);
+            string expected = parser.parse()->toJSON();
+
+            Lexer viewLexer(text.data(), text.size());
+            Parser streamParser(viewLexer);
+            streamParser.streamArrayAt("telemetry.buckets");
+            auto result = streamParser.parse();
+            ostringstream out;
+            {
+                OutputSink sink(out);
+                JsonEmitter emitter(sink);
+                result->emit(emitter);
             }
-            eat(TokenType::RPAREN);
-            return array;
+            if (out.str() != expected || result->toJSON() != expected) {
+                throw runtime_error("вывод отличается: " + out.str());
+            }
+            // проверочный проход не оставляет элементы ни в арене, ни в пуле строк:
+            // их размер одинаков для массива из 10 и из 20000 разных строк
+            size_t pooled[2], arenaBytes[2];
+            for (int pass = 0; pass < 2; ++pass) {
+                string big = "name = \"outside\"\nlist = #(";
+                for (int i = 0; i < (pass == 0 ? 10 : 20000); ++i) {
+                    big += " { id = \"item" + to_string(i) + "\" tags = #( \"t" + to_string(i) + "\" 0x1 ) }";
+                }
+                big += " )";
+                StringPool pool;
+                NodeArena arena;
+                ParseState state;
+                state.arena = &arena;
+                Lexer bigLexer(big.data(), big.size());
+                Parser bigParser(bigLexer, state);
+                bigParser.streamArrayAt("list");
+                bigParser.internStrings(pool);
+                auto root = bigParser.parse();
+                pooled[pass] = pool.size();
+                arenaBytes[pass] = arena.capacity();
+            }
+            if (pooled[0] != pooled[1] || arenaBytes[0] != arenaBytes[1]) {
+                throw runtime_error("память растёт с длиной потокового массива: пул " + to_string(pooled[1]) +
+                    " строк, арена " + to_string(arenaBytes[1]) + " байт");
+            }
+            cout << "Тест 10 пройден: " << out.str() << endl;
         }
-        else if (currentToken.type == TokenType::QUESTION) {
-            eat(TokenType::QUESTION);
-            eat(TokenType::LBRACKET);
-            string constantName = currentToken.value;
-            eat(TokenType::IDENTIFIER);
-            eat(TokenType::RBRACKET);
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 10 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 11: Вывод записей верхнего уровня по мере разбора, в порядке исходного текста
+    {
+        try {
+            Lexer lexer("b = 0x1\nglobal C = 0x2\na = { x = ?[C] }");
+            Parser parser(lexer);
+            ostringstream out;
+            {
+                OutputSink sink(out);
+                JsonEmitter emitter(sink);
+                EntryWriter writer(emitter, 1);
+                parser.parseEntries([&writer](const Symbol& key, NodeRef<ASTNode> value) {
+                    writer.add(key, value);
+                });
+                writer.finish();
+            }
+            if (out.str() != "{\n  \"b\": 1,\n  \"a\": {\n    \"x\": 2\n  }\n}") {
+                throw runtime_error("неожиданный вывод: " + out.str());
+            }
+            cout << "Тест 11 пройден: " << out.str() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 11 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 12: Точный размер и прямая параллельная запись совпадают с toJSON()
+    {
+        try {
+            Lexer lexer("global C = { x = 0x7FFFFFFFFFFFFFFF y = #( { z = \"q\" } ) }\n"
+                "a = ?[C]\nb = { c = ?[C] d = #( ?[C] 0x0 ) }\ne = { }\nf = \"s\"");
+            Parser parser(lexer);
+            auto result = parser.parse();
+            string expected = result->toJSON();
+            size_t size = result->jsonSize().at(0);
+            string buffer(size, '\0');
+            dynamic_cast<const ObjectNode&>(*result).writeJSONParallel(&buffer[0], 4);
+            if (size != expected.size() || buffer != expected) {
+                throw runtime_error("вывод отличается: " + buffer);
+            }
+            cout << "Тест 12 пройден: " << buffer << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 12 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 13: Параллельная сериализация по кускам совпадает с последовательной
+    {
+        try {
+            Lexer lexer("global C = { x = #( 0x1 0x2 0x3 ) y = #( { z = \"q\" } { w = 0x4 } ) }\n"
+                "a = ?[C]\nb = { c = ?[C] d = #( ?[C] 0x0 #( 0x5 0x6 ) ) e = { } }\nf = \"s\"");
+            Parser parser(lexer);
+            auto result = parser.parse();
+            string expected = result->toJSON();
+            // кусок в 1 байт заставляет делить каждый контейнер
+            ParallelJsonWriter writer(4, 1);
+            string joined;
+            for (const auto& piece : writer.serialize(*result)) joined += piece;
+            if (joined != expected) {
+                throw runtime_error("вывод отличается: " + joined);
+            }
+            cout << "Тест 13 пройден: " << joined << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 13 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 14: Двоичные форматы MessagePack и CBOR
+    {
+        try {
+            Lexer lexer("a = #( 0x1 0xFF 0x10000 ) b = { c = \"hi\" d = true }");
+            Parser parser(lexer);
+            auto result = parser.parse();
+            auto encode = [&result](const string& format) {
+                ostringstream out;
+                {
+                    OutputSink sink(out);
+                    auto emitter = makeEmitter(format, sink);
+                    result->emit(*emitter);
+                }
+                ostringstream hex;
+                for (unsigned char c : out.str()) hex << setw(2) << setfill('0') << std::hex << int(c);
+                return hex.str();
+            };
+            string msgpack = encode("msgpack");
+            string cbor = encode("cbor");
+            if (msgpack != "82a16193" "01" "ccff" "ce00010000" "a16282a163a26869a164c3") {
+                throw runtime_error("MessagePack: " + msgpack);
+            }
+            if (cbor != "a2616183" "01" "18ff" "1a00010000" "6162a2616362686961" "64f5") {
+                throw runtime_error("CBOR: " + cbor);
+            }
+            cout << "Тест 14 пройден: msgpack " << msgpack << ", cbor " << cbor << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 14 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 15: Один обход дерева на несколько форматов
+    {
+        try {
+            Lexer lexer("a = #( 0x1 \"x\" ) b = { c = false }");
+            Parser parser(lexer);
+            auto result = parser.parse();
+            ostringstream json, cbor, teeJson, teeCbor;
+            {
+                OutputSink jsonSink(json), cborSink(cbor);
+                JsonEmitter jsonEmitter(jsonSink);
+                CborEmitter cborEmitter(cborSink);
+                result->emit(jsonEmitter);
+                result->emit(cborEmitter);
+            }
+            {
+                OutputSink jsonSink(teeJson), cborSink(teeCbor);
+                JsonEmitter jsonEmitter(jsonSink);
+                CborEmitter cborEmitter(cborSink);
+                TeeEmitter tee;
+                tee.add(jsonEmitter);
+                tee.add(cborEmitter);
+                result->emit(tee);
+            }
+            if (teeJson.str() != json.str() || teeCbor.str() != cbor.str()) {
+                throw runtime_error("вывод через TeeEmitter отличается");
+            }
+            cout << "Тест 15 пройден: " << teeJson.str() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 15 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 16: Канонический JSON (RFC 8785) и SHA-256 по мере записи
+    {
+        try {
+            Lexer lexer("b = #( 0x20000000000001 0x7FFFFFFFFFFFFFFF \"c:\\dir\ttab\" ) a = { y = true x = { } }");
+            Parser parser(lexer);
+            auto result = parser.parse();
+            ostringstream out;
+            Sha256 digest;
+            {
+                OutputSink sink(out);
+                sink.hashWith(digest);
+                CanonicalJsonEmitter emitter(sink);
+                result->emit(emitter);
+            }
+            string expected = "{\"a\":{\"x\":{},\"y\":true},\"b\":[9007199254740992,9223372036854776000,\"c:\\\\dir\\ttab\"]}";
+            if (out.str() != expected) {
+                throw runtime_error("неожиданный вывод: " + out.str());
+            }
+            Sha256 whole;
+            whole.update(expected.data(), expected.size());
+            Sha256 abc;
+            abc.update("abc", 3);
+            if (digest.hexDigest() != whole.hexDigest() ||
+                abc.hexDigest() != "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") {
+                throw runtime_error("неверный SHA-256");
+            }
+            cout << "Тест 16 пройден: " << out.str() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 16 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 17: Интернированные ключи хранят готовые байты для каждого формата
+    {
+        try {
+            const Symbol& first = SymbolTable::shared().intern("timeout");
+            const Symbol& second = SymbolTable::shared().intern(string("time") + "out");
+            if (&first != &second || first.json != "\"timeout\": " || first.canonical != "\"timeout\":" ||
+                first.msgpack != "\xa7timeout" || first.cbor != "\x67timeout") {
+                throw runtime_error("неверное представление ключа");
+            }
+            SymbolTable own;
+            const Symbol& local = own.intern("timeout");
+            if (&local == &first || own.size() != 1 || local.json != first.json) {
+                throw runtime_error("собственная таблица ключей делит ключи с общей");
+            }
+            own.clear();
+            if (own.size() != 0) throw runtime_error("таблица ключей не очищена");
+            cout << "Тест 17 пройден: " << first.json << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 17 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 18: Отступы из таблицы: глубокая вложенность, ширина 4 и табуляция
+    {
+        try {
+            string text = "root = ";
+            for (int i = 0; i < 600; ++i) text += "{ k = ";
+            text += "0x1";
+            for (int i = 0; i < 600; ++i) text += " }";
+            Lexer lexer(text);
+            Parser parser(lexer);
+            auto deep = parser.parse();
+            ostringstream out;
+            {
+                OutputSink sink(out);
+                JsonEmitter emitter(sink);
+                deep->emit(emitter);
+            }
+            if (out.str() != deep->toJSON()) {
+                throw runtime_error("отступы глубже таблицы отличаются от toJSON()");
+            }
+
+            Lexer smallLexer("a = { b = { c = 0x1 } d = #( { e = 0x2 } ) }");
+            Parser smallParser(smallLexer);
+            auto result = smallParser.parse();
+            ostringstream wide, tabs;
+            {
+                OutputSink wideSink(wide), tabSink(tabs);
+                IndentTable four(4), tab(1, '\t');
+                JsonEmitter wideEmitter(wideSink, four), tabEmitter(tabSink, tab);
+                result->emit(wideEmitter);
+                result->emit(tabEmitter);
+            }
+            if (wide.str() != "{\n    \"a\": {\n        \"b\": {\n            \"c\": 1\n        },\n"
+                "        \"d\": [{\n    \"e\": 2\n}]\n    }\n}" ||
+                tabs.str() != "{\n\t\"a\": {\n\t\t\"b\": {\n\t\t\t\"c\": 1\n\t\t},\n"
+                "\t\t\"d\": [{\n\t\"e\": 2\n}]\n\t}\n}") {
+                throw runtime_error("неожиданный вывод: " + wide.str() + tabs.str());
+            }
+            cout << "Тест 18 пройден: " << tabs.str() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 18 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 19: Строки-ссылки на внешний буфер ведут себя как копии: многострочные строки,
+    // "true" в кавычках и позиции в сообщениях об ошибках
+    {
+        string text = "a = { s = \"line1\nline2\" t = \"true\" u = \"\" v = #( \"x\" \"y z\" ) }";
+        string broken = "a = { s = \"multi\nline\" = }";
+        try {
+            Lexer lexer(text);
+            Parser parser(lexer);
+            string expected = parser.parse()->toJSON();
+
+            Lexer viewLexer(text.data(), text.size());
+            Parser viewParser(viewLexer);
+            auto result = viewParser.parse();
+            ostringstream out;
+            {
+                OutputSink sink(out);
+                JsonEmitter emitter(sink);
+                result->emit(emitter);
+            }
+            if (result->toJSON() != expected || out.str() != expected) {
+                throw runtime_error("вывод отличается: " + out.str());
+            }
+
+            string ownedError, viewError;
+            try {
+                Lexer brokenLexer(broken);
+                Parser(brokenLexer).parse();
+            }
+            catch (const runtime_error& e) {
+                ownedError = e.what();
+            }
+            try {
+                Lexer brokenView(broken.data(), broken.size());
+                Parser(brokenView).parse();
+            }
+            catch (const runtime_error& e) {
+                viewError = e.what();
+            }
+            if (ownedError.empty() || ownedError != viewError) {
+                throw runtime_error("ошибки отличаются: " + ownedError + " / " + viewError);
+            }
+            cout << "Тест 19 пройден: " << out.str() << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 19 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 20: Пул строк: повторы становятся одним узлом, вывод во всех форматах не меняется
+    {
+        string text = "global DB = \"postgresql\"\n"
+            "a = { host = \"localhost\" mode = \"async\" db = ?[DB] }\n"
+            "b = { host = \"localhost\" mode = \"as\\ync\" db = \"postgresql\" list = #( \"localhost\" \"x\" ) }";
+        try {
+            const char* formats[] = { "json", "msgpack", "cbor", "canonical" };
+            Lexer plainLexer(text);
+            Parser plainParser(plainLexer);
+            auto plain = plainParser.parse();
+
+            StringPool pool;
+            Lexer lexer(text.data(), text.size());
+            Parser parser(lexer);
+            parser.internStrings(pool);
+            auto interned = parser.parse();
+            if (pool.size() != 5 || pool.requests() != 8) {
+                throw runtime_error("в пуле " + to_string(pool.size()) + " строк из " + to_string(pool.requests()));
+            }
+            for (const char* format : formats) {
+                ostringstream expected, actual;
+                {
+                    OutputSink expectedSink(expected), actualSink(actual);
+                    plain->emit(*makeEmitter(format, expectedSink));
+                    interned->emit(*makeEmitter(format, actualSink));
+                }
+                if (expected.str() != actual.str()) {
+                    throw runtime_error(string("вывод отличается в формате ") + format);
+                }
+            }
+            if (interned->toJSON() != plain->toJSON()) {
+                throw runtime_error("toJSON() отличается");
+            }
+            // кодировки строятся только для форматов, в которые строку выводили
+            InternedString lazy("long enough to live on the heap", 31);
+            size_t bare = lazy.heapBytes();
+            if (lazy.json() != "\"long enough to live on the heap\"" || lazy.heapBytes() <= bare) {
+                throw runtime_error("кодировка json не построена при выводе");
+            }
+            if (lazy.heapBytes() != bare + MemoryReport::heapBytes(lazy.json())) {
+                throw runtime_error("построены лишние кодировки");
+            }
+            cout << "Тест 20 пройден: " << pool.size() << " строк на " << pool.requests() << " вхождений" << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 20 не пройден: " << e.what() << endl;
+        }
+    }
+
+    // Тест 21: Встроенное хранение детей: рост за пределы встроенной ёмкости, порядок ключей
+    // и правило "последнее значение побеждает" при пакетной сортировке свойств
+    {
+        try {
+            auto probe = makeNode<NumberNode>(7);
+            {
+                ArrayNode array;
+                for (int i = 0; i < 20; ++i) array.addElement(probe);
+                if (array.getElements().isInline() || probe.useCount() != 21) {
+                    throw runtime_error("неверный рост массива");
+                }
+            }
+            if (probe.useCount() != 1) {
+                throw runtime_error("элементы массива не освобождены");
+            }
+
+            string text = "o = { k9 = 0x9 k1 = 0x1 k5 = 0x5 k1 = 0x11 k3 = 0x3 k7 = 0x7 k2 = 0x2 k8 = 0x8 "
+                "k4 = 0x4 k6 = 0x6 k0 = 0x0 k5 = 0x15 }\ns = { a = 0x1 b = 0x2 b = 0x3 }\no = 0x0";
+            Lexer lexer(text);
+            Parser parser(lexer);
+            auto result = parser.parse();
 
-            if (constants.find(constantName) == constants.end()) {
-                throw runtime_error("Неизвестная константа: " + constantName);
+            ObjectNode expected;
+            auto objectO = makeNode<ObjectNode>();
+            const int keys[] = { 9, 1, 5, 1, 3, 7, 2, 8, 4, 6, 0, 5 };
+            const int values[] = { 9, 1, 5, 0x11, 3, 7, 2, 8, 4, 6, 0, 0x15 };
+            for (int i = 0; i < 12; ++i) {
+                objectO->addProperty("k" + to_string(keys[i]), makeNode<NumberNode>(values[i]));
             }
-            return constants[constantName];
+            auto objectS = makeNode<ObjectNode>();
+            objectS->addProperty("b", makeNode<NumberNode>(2));
+            objectS->addProperty("a", makeNode<NumberNode>(1));
+            objectS->addProperty("b", makeNode<NumberNode>(3));
+            expected.addProperty("s", objectS);
+            expected.addProperty("o", objectO);
+            expected.addProperty("o", makeNode<NumberNode>(0));
+            if (result->toJSON() != expected.toJSON() || objectO->getProperties().size() != 10) {
+                throw runtime_error("неожиданный вывод: " + result->toJSON());
+            }
+            cout << "Тест 21 пройден: " << objectO->toJSON() << endl;
         }
-        else if (currentToken.type == TokenType::LBRACE) {
-            return parseObject();
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 21 не пройден: " << e.what() << endl;
         }
-
-        throw runtime_error("Неожиданный токен в значении: " + currentToken.value + " в строке " + to_string(currentToken.line));
     }
 
-    shared_ptr<ObjectNode> parseObject() {
-        auto obj = make_shared<ObjectNode>();
-        eat(TokenType::LBRACE);
-
-        while (currentToken.type != TokenType::RBRACE && currentToken.type != TokenType::EOF_TOKEN) {
-            if (currentToken.type == TokenType::IDENTIFIER) {
-                string key = currentToken.value;
-                eat(TokenType::IDENTIFIER);
-                eat(TokenType::EQUALS);
-                auto value = parseValue();
-                obj->addProperty(key, value);
+    // Тест 22: Предварительный проход: точные ёмкости контейнеров и тот же результат разбора
+    {
+        string text = "global C = { x = #( 0x1 0x2 ) }\n"
+            "a = #( 0x1 \"s\" ?[C] #( 0x2 0x3 0x4 ) { k = 0x5 m = 0x6 } 0x7 0x8 0x9 0xa 0xb )\n"
+            "{ u = 0x1 }\nb = { c = 0x1 c = 0x2 d = #( ) }";
+        try {
+            InputShape shape = countShape(text.data(), text.size());
+            const size_t expected[] = { 1, 2, 10, 3, 2, 1, 3, 0 };
+            if (shape.children != vector<size_t>(expected, expected + 8) || shape.topLevel != 3 || shape.tokens != 62) {
+                throw runtime_error("неверный подсчёт: " + to_string(shape.children.size()) + " контейнеров, " +
+                    to_string(shape.topLevel) + " записей, " + to_string(shape.tokens) + " токенов");
             }
-            else {
-                throw runtime_error("Ожидаемый идентификатор в объекте");
+
+            Lexer plainLexer(text);
+            Parser plainParser(plainLexer);
+            string plain = plainParser.parse()->toJSON();
+
+            Lexer lexer(text.data(), text.size());
+            Parser parser(lexer);
+            parser.presize(shape);
+            auto result = parser.parse();
+            auto root = nodeCast<ObjectNode>(result);
+            auto array = nodeCast<ArrayNode>(root->getProperties()[0].second);
+            if (result->toJSON() != plain || array->getElements().capacity() != 10) {
+                throw runtime_error("результат отличается: " + result->toJSON());
             }
+            cout << "Тест 22 пройден: " << shape.tokens << " токенов" << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 22 не пройден: " << e.what() << endl;
         }
-
-        eat(TokenType::RBRACE);
-        return obj;
     }
 
-public:
-    Parser(Lexer& l) : lexer(l), currentToken(l.nextToken()) {}
-
-    shared_ptr<ASTNode> parse() {
-        auto root = make_shared<ObjectNode>();
-
-        while (currentToken.type != TokenType::EOF_TOKEN) {
-            if (currentToken.type == TokenType::GLOBAL) {
-                eat(TokenType::GLOBAL);
-                string name = currentToken.value;
-                eat(TokenType::IDENTIFIER);
-                eat(TokenType::EQUALS);
-                auto value = parseValue();
-                constants[name] = value;
-            }
-            else if (currentToken.type == TokenType::IDENTIFIER) {
-                string key = currentToken.value;
-                eat(TokenType::IDENTIFIER);
-                eat(TokenType::EQUALS);
-                auto value = parseValue();
-                root->addProperty(key, value);
+    // Тест 23: Счётчики ссылок в узлах: константы разделяются без копий, замороженное дерево
+    // с потоковым массивом выводится одновременно из нескольких потоков
+    {
+        string text = "global C = { x = #( 0x1 0x2 ) }\n"
+            "a = { c1 = ?[C] c2 = ?[C] }\nlist = #( ?[C] 0x3 #( ?[C] ) )";
+        try {
+            Lexer plainLexer(text);
+            Parser plainParser(plainLexer);
+            auto plain = plainParser.parse();
+            auto a = nodeCast<ObjectNode>(nodeCast<ObjectNode>(plain)->getProperties()[0].second);
+            const NodeRef<ASTNode>& shared = a->getProperties()[0].second;
+            // две ссылки из объекта a, две из массива list и одна в константах парсера
+            if (shared.useCount() != 5 || shared.get() != a->getProperties()[1].second.get()) {
+                throw runtime_error("константа скопирована: " + to_string(shared.useCount()));
             }
-            else if (currentToken.type == TokenType::LBRACE) {
-                auto obj = parseObject();
-                root->addProperty("unnamed", obj);
+            string expected = plain->toJSON();
+
+            Lexer lexer(text.data(), text.size());
+            Parser parser(lexer);
+            parser.streamArrayAt("list");
+            FrozenTree tree(parser.parse());
+            vector<string> outputs(4);
+            vector<thread> readers;
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                readers.emplace_back([&tree, &outputs, i]() {
+                    ostringstream out;
+                    {
+                        OutputSink sink(out);
+                        JsonEmitter emitter(sink);
+                        for (int repeat = 0; repeat < 50; ++repeat) tree.root().emit(emitter);
+                    }
+                    outputs[i] = out.str();
+                });
             }
-            else {
-                throw runtime_error("Неожиданный токен: " + currentToken.value + " в строке " + to_string(currentToken.line));
+            for (auto& reader : readers) reader.join();
+            string repeated;
+            for (int repeat = 0; repeat < 50; ++repeat) repeated += expected;
+            for (const auto& output : outputs) {
+                if (output != repeated) throw runtime_error("вывод потока отличается");
             }
+            cout << "Тест 23 пройден: " << expected << endl;
+        }
+        catch (const exception& e) {
+            failures++;
+            cout << "Тест 23 не пройден: " << e.what() << endl;
         }
-
-        return root;
     }
-};
-
-void runTests() {
-    cout << "Выполнение тестов...\n";
 
-    // Тест 1: Простое число
+    // Тест 24: Каждый доступный уровень ядер совпадает со скалярным на всех длинах и классах
     {
-        Lexer lexer("port = 0x1A");
-        Parser parser(lexer);
         try {
-            auto result = parser.parse();
-            cout << "Тест 1 пройден: " << result->toJSON() << endl;
+            const char alphabet[] = " \t\n\r\v\f09afAFgzGZ_\"\\\x01\x1f#={}()\x80\xff";
+            string data;
+            uint32_t seed = 12345;
+            for (int i = 0; i < 4096; ++i) {
+                seed = seed * 1103515245u + 12345u;
+                size_t pick = (seed >> 16) % (sizeof(alphabet) - 1);
+                // длинные серии одного класса, чтобы ядра проходили целые векторы
+                data.append(1 + (seed >> 8) % 70, alphabet[pick]);
+            }
+            data += '\0';
+            data += " \"tail";
+            TextKernels saved = textKernels;
+            TextKernels scalar = kernelsAt("scalar");
+            string text = "global P = 0x1F\n" + string(100, ' ') + "a = { c = \"" + string(90, 'x') + "\\y\ny\" " +
+                string(70, 'd') + "_1 = #( 0x" + string(15, 'A') + " ?[P] )\t\t}\n b = \"true\"";
+            Lexer scalarLexer(text);
+            string expected = Parser(scalarLexer).parse()->toJSON();
+            string checked;
+            for (const char* level : kernelLevels) {
+                if (!cpuSupports(level)) continue;
+                TextKernels kernels = kernelsAt(level);
+                size_t (*TextKernels::*scans[])(const char*, size_t) = {
+                    &TextKernels::skipSpaces, &TextKernels::hexDigits, &TextKernels::identifier,
+                    &TextKernels::stringBody, &TextKernels::unescaped };
+                for (auto scanKernelOf : scans) {
+                    for (size_t start = 0; start < data.size(); start += 7) {
+                        size_t size = data.size() - start;
+                        if ((kernels.*scanKernelOf)(data.data() + start, size) != (scalar.*scanKernelOf)(data.data() + start, size)) {
+                            throw runtime_error(string("ядро уровня ") + level + " расходится со скалярным");
+                        }
+                    }
+                }
+                const long long numbers[] = { 0, 7, -7, 10, 99, 100, -12345, 9223372036854775807LL, -9223372036854775807LL - 1 };
+                for (long long number : numbers) {
+                    char buffer[24];
+                    if (string(buffer, kernels.formatInteger(buffer, number)) != to_string(number)) {
+                        throw runtime_error(string("неверное число уровня ") + level + ": " + to_string(number));
+                    }
+                }
+                textKernels = kernels;
+                Lexer lexer(text.data(), text.size());
+                string json = Parser(lexer).parse()->toJSON();
+                textKernels = saved;
+                if (json != expected) {
+                    throw runtime_error(string("разбор на уровне ") + level + ": " + json);
+                }
+                checked += string(checked.empty() ? "" : ", ") + level;
+            }
+            textKernels = saved;
+            cout << "Тест 24 пройден: " << checked << endl;
         }
         catch (const exception& e) {
-            cout << "Тест 1 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 24 не пройден: " << e.what() << endl;
         }
     }
 
-    // Тест 2: Массив
+    // Тест 25: Дифференциальная проверка всех движков на случайных конфигурациях
+    {
+        ostringstream log;
+        size_t mismatches = runDifferentialFuzz(300, 2024, log);
+        if (mismatches == 0) {
+            cout << "Тест 25 пройден: " << log.str();
+        }
+        else {
+            failures++;
+            cout << "Тест 25 не пройден: " << log.str();
+        }
+    }
+
+    // Тест 26: Повторные преобразования через Converter не выделяют память
     {
-        Lexer lexer("ports = #( 0x01 0x02 0x03 )");
-        Parser parser(lexer);
         try {
-            auto result = parser.parse();
-            cout << "Тест 2 пройден: " << result->toJSON() << endl;
+            string text =
+                "global WINDOW_WIDTH = 0x500\n"
+                "global BACKGROUND_COLOR = 0xFFFFFF\n"
+                "application = {\n"
+                "    name = \"Graphics Editor with a long name\"\n"
+                "    window = { width = ?[WINDOW_WIDTH] fullscreen = false background_color = ?[BACKGROUND_COLOR] }\n"
+                "    brush_sizes = #( 0x01 0x02 0x04 0x08 0x10 0x20 0x40 0x80 0x100 0x200 )\n"
+                "    tools = #( \"brush\" \"eraser\" { kind = \"fill\" tolerance = 0x10 } )\n"
+                "    preferences = { k = 0x1 j = 0x2 i = 0x3 h = 0x4 g = 0x5 f = 0x6 e = 0x7 d = 0x8 c = 0x9\n"
+                "        b = 0xA a = 0xB autosave_interval = 0x3C default_format = \"PNG\" autosave = true }\n"
+                "}\n"
+                "{ unnamed_section_value = 0x7FFFFFFF }\n";
+            Lexer lexer(text);
+            string expected = Parser(lexer).parse()->toJSON();
+            Converter converter;
+            for (int i = 0; i < 3; ++i) converter.convert(text);
+#ifdef CLT_COUNT_ALLOCATIONS
+            size_t before = heapAllocations.load();
+#endif
+            bool same = true;
+            for (int i = 0; i < 100; ++i) {
+                same = same && converter.convert(text) == expected;
+            }
+            if (!same) {
+                throw runtime_error("вывод отличается от Parser::parse(): " + converter.convert(text));
+            }
+#ifdef CLT_COUNT_ALLOCATIONS
+            size_t allocations = heapAllocations.load() - before;
+            if (allocations != 0) {
+                throw runtime_error("выделений памяти за 100 преобразований: " + to_string(allocations));
+            }
+            cout << "Тест 26 пройден: 100 преобразований без выделений памяти, арена "
+                << converter.arenaCapacity() << " байт" << endl;
+#else
+            // без счётчика свойство не проверено, поэтому тест не считается пройденным
+            cout << "Тест 26 пропущен: выделения памяти не считаются в сборке без CLT_COUNT_ALLOCATIONS "
+                << "(вывод 100 преобразований совпал)" << endl;
+#endif
         }
         catch (const exception& e) {
-            cout << "Тест 2 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 26 не пройден: " << e.what() << endl;
         }
     }
 
-    // Тест 3: Константы
+    // Тест 27: Блочное хранение больших массивов и буфера вывода
     {
-        Lexer lexer("global MAX_SIZE = 0x100\nsize = ?[MAX_SIZE]");
-        Parser parser(lexer);
         try {
-            auto result = parser.parse();
-            cout << "Тест 3 пройден: " << result->toJSON() << endl;
+            string text = "big = #(";
+            string expected = "{\n  \"big\": [";
+            for (int i = 0; i < 5000; ++i) {
+                text += " 0x" + to_string(i % 10);
+                expected += (i > 0 ? ", " : "") + to_string(i % 10);
+            }
+            text += " )";
+            expected += "]\n}";
+            InputShape shape = countShape(text.data(), text.size());
+            for (int pass = 0; pass < 2; ++pass) {
+                Lexer lexer(text.data(), text.size());
+                Parser parser(lexer);
+                if (pass == 1) parser.presize(shape);
+                auto root = nodeCast<ObjectNode>(parser.parse());
+                auto array = nodeCast<ArrayNode>(root->getProperties()[0].second);
+                const ArrayNode::Elements& elements = array->getElements();
+                const NodeRef<ASTNode>* moved = &elements[3000];
+                for (int i = 0; i < 3000; ++i) array->addElement(makeNode<NumberNode>(i));
+                if (&elements[3000] != moved || elements.size() != 8000 || elements.blocksUsed() != 7) {
+                    throw runtime_error("элементы больших массивов перемещаются при росте");
+                }
+            }
+            Lexer lexer(text.data(), text.size());
+            if (Parser(lexer).parse()->toJSON() != expected) {
+                throw runtime_error("неверный вывод большого массива");
+            }
+
+            ChunkedBuffer buffer(100);
+            string written;
+            for (int i = 0; i < 50; ++i) {
+                string piece(i % 7 == 0 ? 150 : 13, static_cast<char>('a' + i % 26));
+                buffer.write(piece.data(), piece.size());
+                written += piece;
+            }
+            string joined;
+            vector<ByteRange> ranges = buffer.ranges();
+            for (const auto& range : ranges) joined.append(range.data, range.size);
+            if (joined != written || buffer.size() != written.size() || ranges.size() != (written.size() + 99) / 100) {
+                throw runtime_error("блоки буфера вывода не совпадают с записанным");
+            }
+            // на больших страницах буфер сбрасывается с тем же порогом, что и без них
+            ostringstream early;
+            OutputSink hugeSink(early, 64 * 1024, true);
+            string chunk(64 * 1024, 'x');
+            hugeSink.write(chunk);
+            if (early.str().size() != chunk.size() || hugeSink.bufferBytes() < hugePageSize) {
+                throw runtime_error("буфер на больших страницах не сброшен после 64 КБ");
+            }
+            cout << "Тест 27 пройден: " << expected.size() << " байт массива из 5000 элементов, "
+                << ranges.size() << " блоков вывода" << endl;
         }
         catch (const exception& e) {
-            cout << "Тест 3 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 27 не пройден: " << e.what() << endl;
         }
     }
 
-    // Тест 4: Объект
+    // Тест 28: Выгрузка поддеревьев во временный файл и вывод из него
     {
-        Lexer lexer("config = { timeout = 0x1E enabled = true }");
-        Parser parser(lexer);
         try {
-            auto result = parser.parse();
-            cout << "Тест 4 пройден: " << result->toJSON() << endl;
+            string text = "global C = { x = 0x1 y = #( 0x2 \"z\" ) }\n"
+                "a = { b = { c = ?[C] d = #( 0x1 { e = true } #( 0x2 0x3 ) ) } f = \"g\" }\n"
+                "list = #(";
+            for (int i = 0; i < 300; ++i) text += " { n = 0x" + to_string(i) + " s = \"v\" }";
+            text += " )\n{ k = 0x5 }";
+            Lexer plainLexer(text);
+            auto plain = Parser(plainLexer).parse();
+            string expectedJson = plain->toJSON();
+            auto binary = [](const ASTNode& root, const string& format) {
+                ostringstream out;
+                {
+                    OutputSink sink(out);
+                    auto emitter = makeEmitter(format, sink, IndentTable::standard());
+                    root.emit(*emitter);
+                }
+                return out.str();
+            };
+            size_t spilled = 0;
+            for (size_t threshold : { size_t(1), size_t(64), size_t(1000) }) {
+                SpillFile spill(temporaryDirectory(), threshold);
+                Lexer lexer(text.data(), text.size());
+                Parser parser(lexer);
+                parser.spillTo(spill);
+                auto root = parser.parse();
+                if (emitToString(*root) != expectedJson || root->toJSON() != expectedJson) {
+                    throw runtime_error("JSON из выгрузки с порогом " + to_string(threshold) + " отличается");
+                }
+                for (const char* format : { "msgpack", "cbor", "canonical" }) {
+                    if (binary(*root, format) != binary(*plain, format)) {
+                        throw runtime_error(string("формат ") + format + " из выгрузки отличается");
+                    }
+                }
+                if (spill.count() == 0) throw runtime_error("ничего не выгружено");
+                // параллельная запись воспроизводит выгруженные части из нескольких потоков сразу
+                string joined;
+                ParallelJsonWriter writer(4, 1);
+                for (const auto& piece : writer.serialize(*root)) joined += piece;
+                if (joined != expectedJson) {
+                    throw runtime_error("параллельный вывод из выгрузки с порогом " + to_string(threshold) + " отличается");
+                }
+                spilled += spill.count();
+            }
+            cout << "Тест 28 пройден: выгружено значений " << spilled << endl;
         }
         catch (const exception& e) {
-            cout << "Тест 4 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 28 не пройден: " << e.what() << endl;
         }
     }
 
-    // Тест 5: Комплексный пример
+    // Тест 29: Отчёт о памяти по видам узлов; общий узел-константа учитывается один раз
     {
-        Lexer lexer("global PORT = 0x50\nserver = { port = ?[PORT] hosts = #( \"host1\" \"host2\" ) }");
-        Parser parser(lexer);
         try {
-            auto result = parser.parse();
-            cout << "Тест 5 пройден: " << result->toJSON() << endl;
+            string text = "global C = { x = 0x1 }\n"
+                "a = { p = ?[C] q = ?[C] s = \"text\" }\n"
+                "list = #( 0x1 0x2 0x3 0x4 0x5 0x6 0x7 0x8 0x9 )";
+            Lexer lexer(text.data(), text.size());
+            ParseState state;
+            Parser parser(lexer, state);
+            auto root = parser.parse();
+            MemoryReport report;
+            root->account(report);
+            accountConstants(report, state.constants);
+            if (report.count("ObjectNode") != 3 || report.count("NumberNode") != 10 ||
+                report.count("ArrayNode") != 1 || report.count("StringNode") != 1) {
+                throw runtime_error("неверное число узлов: объектов " + to_string(report.count("ObjectNode"))
+                    + ", чисел " + to_string(report.count("NumberNode")));
+            }
+            if (report.bytes("NumberNode") != 10 * sizeof(NumberNode) ||
+                report.bytes("буферы элементов массивов") == 0 ||
+                report.count("таблицы констант (узлы map)") != 1) {
+                throw runtime_error("неверные байты по категориям");
+            }
+            ostringstream out;
+            printMemoryReport(out, report, nullptr);
+            if (out.str().find("всего: " + to_string(report.total()) + " байт") == string::npos) {
+                throw runtime_error("в отчёте нет итога: " + out.str());
+            }
+            cout << "Тест 29 пройден: " << report.total() << " байт в дереве из "
+                << report.count("ObjectNode") + report.count("NumberNode") + 2 << " узлов" << endl;
         }
         catch (const exception& e) {
-            cout << "Тест 5 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 29 не пройден: " << e.what() << endl;
         }
     }
 
-    // Тест 6: Вложенные объекты
+    // Тест 30: Счётчики процессора по этапам; вложенный этап вычитается из внешнего
     {
-        Lexer lexer("app = { database = { host = \"localhost\" port = 0x2276 } }");
-        Parser parser(lexer);
         try {
-            auto result = parser.parse();
-            cout << "Тест 6 пройден: " << result->toJSON() << endl;
+            PerfCounters perf;
+            PerfCounters::Reading before = perf.read();
+            PerfCounters::Mark outer = perf.start();
+            volatile uint64_t sink = 0;
+            for (int i = 0; i < 2000000; ++i) sink += i;
+            PerfCounters::Mark inner = perf.start();
+            for (int i = 0; i < 2000000; ++i) sink += i;
+            perf.finish("внутренний", inner);
+            perf.finish("внешний", outer);
+            PerfCounters::Reading after = perf.read();
+            const auto& phases = perf.finished();
+            if (phases.size() != 2 || phases[0].name != "внутренний" || phases[1].name != "внешний") {
+                throw runtime_error("неверный список этапов");
+            }
+            int measured = 0;
+            for (int i = 0; i < PerfCounters::eventCount; ++i) {
+                if (!perf.opened(i) || after.running[i] != after.enabled[i]) continue;
+                double sum = phases[0].total.values[i] + phases[1].total.values[i];
+                if (phases[0].total.values[i] < 0 || phases[1].total.values[i] < 0 ||
+                    sum > after.value[i] - before.value[i]) {
+                    throw runtime_error(string("этапы не сходятся с общим счётчиком: ") + PerfCounters::eventName(i));
+                }
+                measured++;
+            }
+            ostringstream report;
+            printPerfCounters(report, perf, 1, 1);
+            if (measured == 0 && report.str().find("недоступны") == string::npos) {
+                throw runtime_error("нет ни счётчиков, ни причины их отсутствия");
+            }
+            cout << "Тест 30 пройден: событий " << measured;
+            if (!perf.error().empty()) cout << ", часть недоступна: " << perf.error();
+            cout << endl;
         }
         catch (const exception& e) {
-            cout << "Тест 6 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 30 не пройден: " << e.what() << endl;
         }
     }
 
-    // Тест 7: Смешанные типы данных
+    // Тест 31: Пакет выполняется от дешёвых заданий к дорогим, отменённое задание не выполняется
     {
-        Lexer lexer("settings = { numbers = #( 0x01 0x02 ) strings = #( \"a\" \"b\" ) flag = true }");
-        Parser parser(lexer);
+        vector<string> files;
         try {
-            auto result = parser.parse();
-            cout << "Тест 7 пройден: " << result->toJSON() << endl;
+            string directory = temporaryDirectory();
+            string big = "global W = 0x10\nlist = #(";
+            for (int i = 0; i < 100; ++i) big += " { w = ?[W] n = 0x" + to_string(i) + " }";
+            big += " )";
+            vector<string> texts = { big, "a = 0x1", "b = { c = \"d\" }", "", "e = #( 0x2 0x3 )" };
+            vector<pair<string, string>> paths;
+            for (size_t i = 0; i < texts.size(); ++i) {
+                string input = directory + "/clt_batch_" + to_string(i) + ".txt";
+                paths.emplace_back(input, input + ".json");
+                files.push_back(input + ".json");
+                // четвёртого входа нет: задание должно завершиться ошибкой, не остановив пакет
+                if (i == 3) continue;
+                ofstream(input) << texts[i];
+                files.push_back(input);
+            }
+            BatchScheduler batch(1, 200);
+            batch.submit(paths);
+            batch.cancel(4);
+            batch.finish();
+            typedef BatchScheduler::Status Status;
+            if (batch.job(0).status != Status::done || batch.job(1).status != Status::done ||
+                batch.job(2).status != Status::done || batch.job(3).status != Status::failed ||
+                batch.job(4).status != Status::cancelled) {
+                throw runtime_error("неверный исход заданий");
+            }
+            // самый дешёвый — несуществующий вход, самый дорогой — большой файл
+            if (batch.job(3).finishedAs != 0 || batch.job(1).finishedAs != 1 ||
+                batch.job(2).finishedAs != 2 || batch.job(0).finishedAs != 4) {
+                throw runtime_error("задания выполнены не по возрастанию стоимости");
+            }
+            Converter converter;
+            for (size_t i : { size_t(0), size_t(2) }) {
+                ifstream output(paths[i].second);
+                string written((istreambuf_iterator<char>(output)), istreambuf_iterator<char>());
+                if (written != converter.convert(texts[i])) throw runtime_error("неверный вывод " + paths[i].second);
+            }
+            ifstream cancelled(paths[4].second);
+            if (cancelled) throw runtime_error("отменённое задание создало выход");
+
+            // только крупные задания: поток для мелких простаивает, остальные всё выполняют
+            BatchScheduler lanes(2, 1);
+            lanes.submit({ paths[0], paths[1] });
+            lanes.finish();
+            if (lanes.job(0).status != Status::done || lanes.job(1).status != Status::done) {
+                throw runtime_error("крупные задания не выполнены при двух потоках");
+            }
+            // нарушение ограничения — ошибка задания, а не отмена
+            BatchScheduler limited(1, 200);
+            ConversionLimits tight;
+            tight.nodes = 3;
+            limited.limit(tight, chrono::milliseconds(0));
+            limited.submit({ paths[0] });
+            limited.finish();
+            if (limited.job(0).status != Status::failed || limited.job(0).error.find("число узлов") == string::npos) {
+                throw runtime_error("задание сверх ограничения не считается ошибочным");
+            }
+            cout << "Тест 31 пройден: " << batch.size() << " заданий по возрастанию стоимости" << endl;
         }
         catch (const exception& e) {
-            cout << "Тест 7 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 31 не пройден: " << e.what() << endl;
         }
+        for (const auto& file : files) remove(file.c_str());
     }
 
-    // Тест 8: Множественные константы
+    // Тест 32: Ограничения глубины, числа узлов и размера вывода; отмена по ходу разбора
     {
-        Lexer lexer("global WIDTH = 0x500\nglobal HEIGHT = 0x300\ndimensions = { width = ?[WIDTH] height = ?[HEIGHT] }");
-        Parser parser(lexer);
         try {
-            auto result = parser.parse();
-            cout << "Тест 8 пройден: " << result->toJSON() << endl;
+            // сообщение исключения ConversionCancelled, "ограничение: " и сообщение LimitExceeded
+            // или пустая строка, если исключения не было
+            auto stopped = [](const function<void()>& body) {
+                try {
+                    body();
+                }
+                catch (const ConversionCancelled& e) {
+                    return string(e.what());
+                }
+                catch (const LimitExceeded& e) {
+                    return "ограничение: " + string(e.what());
+                }
+                return string();
+            };
+            string nested = "a = ";
+            for (int i = 0; i < 50; ++i) nested += "#( ";
+            for (int i = 0; i < 50; ++i) nested += ") ";
+            string wide = "a = #(";
+            for (int i = 0; i < 10000; ++i) wide += " 0x1";
+            wide += " )";
+
+            Converter converter;
+            ConversionLimits limits;
+            limits.depth = 10;
+            converter.limit(limits);
+            if (stopped([&] { converter.convert(nested); }).find("ограничение: превышена глубина") == string::npos) {
+                throw runtime_error("глубина вложенности не ограничена");
+            }
+            limits.depth = 0;
+            limits.nodes = 100;
+            converter.limit(limits);
+            if (stopped([&] { converter.convert(wide); }).find("ограничение: превышено число узлов") == string::npos) {
+                throw runtime_error("число узлов не ограничено");
+            }
+            limits.nodes = 0;
+            limits.outputBytes = 1000;
+            converter.limit(limits);
+            if (stopped([&] { converter.convert(wide); }).find("ограничение: превышен размер вывода") == string::npos) {
+                throw runtime_error("размер вывода не ограничен");
+            }
+            // после прерванных преобразований Converter работает как обычно
+            limits = ConversionLimits();
+            converter.limit(limits);
+            Lexer plain(nested);
+            if (converter.convert(nested) != Parser(plain).parse()->toJSON()) {
+                throw runtime_error("Converter неверно работает после прерываний");
+            }
+            // глубина ограничена и по умолчанию: 100000 уровней не доходят до переполнения стека
+            string deep = "a = ";
+            for (int i = 0; i < 100000; ++i) deep += "#( ";
+            if (stopped([&] { converter.convert(deep); }).find("ограничение: превышена глубина вложенности: больше 4096")
+                == string::npos) {
+                throw runtime_error("глубина не ограничена по умолчанию");
+            }
+            Lexer deepLexer(deep);
+            if (stopped([&] { Parser(deepLexer).parse(); }).find("ограничение: превышена глубина") == string::npos) {
+                throw runtime_error("Parser без limit() не ограничивает глубину");
+            }
+
+            // отмена срабатывает внутри разбора, на очередной проверке лексера
+            CancellationToken token;
+            token.cancel();
+            Lexer lexer(wide.data(), wide.size());
+            lexer.cancelWith(&token);
+            if (stopped([&] { Parser(lexer).parse(); }) != "задание отменено") {
+                throw runtime_error("разбор не прерван отменой");
+            }
+            CancellationToken expired;
+            expired.expireAt(chrono::steady_clock::now());
+            if (stopped([&] { converter.convert("a = 0x1", 7, &expired); }) != "истёк срок задания") {
+                throw runtime_error("срок не проверен перед выводом");
+            }
+
+            ostringstream out;
+            limits.outputBytes = 100;
+            {
+                OutputSink sink(out);
+                sink.limit(limits, nullptr);
+                auto emitter = makeEmitter("json", sink, IndentTable::standard());
+                Lexer source(wide);
+                auto root = Parser(source).parse();
+                if (stopped([&] { root->emit(*emitter); }).find("ограничение: превышен размер вывода") == string::npos) {
+                    throw runtime_error("вывод через OutputSink не ограничен");
+                }
+            }
+            if (out.str().size() > 100) throw runtime_error("выведено больше ограничения");
+            cout << "Тест 32 пройден: ограничения и отмена прерывают разбор и вывод" << endl;
         }
         catch (const exception& e) {
-            cout << "Тест 8 не пройден: " << e.what() << endl;
+            failures++;
+            cout << "Тест 32 не пройден: " << e.what() << endl;
         }
     }
 
     cout << "Тесты завершены.\n";
+    if (failures > 0) cout << "Не пройдено тестов: " << failures << "\n";
+    return failures;
+}
+
+// Длительность этапов работы для --stats: mark(name) закрывает этап, начатый предыдущей отметкой.
+// С countWith() те же этапы получают и счётчики процессора (--perf-counters)
+class PhaseTimer {
+    chrono::steady_clock::time_point last = chrono::steady_clock::now();
+    vector<pair<string, double>> phases;
+    PerfCounters* perf = nullptr;
+    PerfCounters::Mark perfMark;
+public:
+    void countWith(PerfCounters& counters) {
+        perf = &counters;
+        perfMark = perf->start();
+    }
+    void mark(const string& name) {
+        auto now = chrono::steady_clock::now();
+        phases.emplace_back(name, chrono::duration<double, milli>(now - last).count());
+        last = now;
+        if (perf) {
+            perf->finish(name, perfMark);
+            perfMark = perf->start();
+        }
+    }
+    const vector<pair<string, double>>& finished() const { return phases; }
+};
+
+// Сколько памяти процесса ядро держит на прозрачных больших страницах (0, если не известно)
+size_t anonHugePageBytes() {
+    ifstream smaps("/proc/self/smaps_rollup");
+    const char* prefix = "AnonHugePages:";
+    string line;
+    while (getline(smaps, line)) {
+        if (line.compare(0, strlen(prefix), prefix) == 0) {
+            return strtoull(line.c_str() + strlen(prefix), nullptr, 10) * 1024;
+        }
+    }
+    return 0;
+}
+
+void printStats(ostream& out, const PhaseTimer& timer, bool hugePages, const SpillFile* spill) {
+    out << "Статистика:\n";
+    for (const auto& phase : timer.finished()) {
+        out << "  " << phase.first << ": " << fixed << setprecision(1) << phase.second << " мс\n";
+    }
+    static const char* const kinds[] = {
+        "большие страницы (MAP_HUGETLB)", "прозрачные большие страницы (MADV_HUGEPAGE)", "обычные страницы", "куча" };
+    out << "  большие страницы " << (hugePages ? "запрошены" : "не запрошены") << "; буферы и арена (пик):\n";
+    for (int i = 0; i < 4; ++i) {
+        if (pageUsage.peak[i] > 0) out << "    " << kinds[i] << ": " << pageUsage.peak[i] << " байт\n";
+    }
+    size_t transparent = anonHugePageBytes();
+    if (transparent > 0) out << "  AnonHugePages процесса: " << transparent << " байт\n";
+    if (spill) out << "  выгружено во временный файл: " << spill->count() << " значений, " << spill->bytes() << " байт\n";
+}
+
+// Значение параметра командной строки: только десятичные цифры и без переполнения
+bool parseNumber(const string& text, unsigned long long& value) {
+    if (text.empty() || text.find_first_not_of("0123456789") != string::npos) return false;
+    errno = 0;
+    value = strtoull(text.c_str(), nullptr, 10);
+    return errno != ERANGE;
 }
 
 int main(int argc, char* argv[]) {
     setlocale(LC_ALL, "RU");
     if (argc == 2 && string(argv[1]) == "--test") {
-        runTests();
-        return 0;
+        return runTests() == 0 ? 0 : 1;
     }
-
-    if (argc != 5) {
-        cerr << "Usage: " << argv[0] << " --input <input_file> --output <output_file>\n";
-        cerr << "Or: " << argv[0] << " --test\n";
-        return 1;
+    if ((argc == 3 || argc == 4) && string(argv[1]) == "--fuzz") {
+        // опечатка в числе не должна превращаться в ноль проверенных конфигураций и успешный выход
+        unsigned long long iterations = 0;
+        unsigned long long seedValue = 0;
+        if (!parseNumber(argv[2], iterations) || iterations == 0 ||
+            (argc == 4 && (!parseNumber(argv[3], seedValue) || seedValue > UINT32_MAX))) {
+            cerr << "Usage: " << argv[0] << " --fuzz <число конфигураций больше 0> [seed от 0 до 4294967295]\n";
+            return 1;
+        }
+        uint32_t seed = argc == 4 ? static_cast<uint32_t>(seedValue) : random_device()();
+        return runDifferentialFuzz(static_cast<size_t>(min<unsigned long long>(iterations, SIZE_MAX)), seed, cout) == 0 ? 0 : 1;
     }
 
-    string inputFile, outputFile;
+    // выход задаётся как "путь" или "формат:путь"; выходов может быть несколько
+    struct OutputTarget {
+        string format;
+        string path;
+    };
+    string inputFile;
+    vector<OutputTarget> outputs;
+    vector<string> streamedArrays;
+    bool streamOutput = false;
+    bool mappedOutput = false;
+    bool parallelOutput = false;
+    string format = "json";
+    bool hashOutputs = false;
+    string hashFile;
+    string indentOption = "2";
+    bool internStrings = false;
+    bool presize = false;
+    bool cpuInfo = false;
+    bool hugePages = false;
+    bool stats = false;
+    bool memoryReport = false;
+    bool perfCounters = false;
+    string spillDirectory;
+    string batchFile;
+    long jobTimeout = 0;
+    long timeLimit = 0;
+    ConversionLimits limits;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    const unsigned maxThreads = threads * 4;
+    // Параметры одиночного преобразования: задания --batch пишут JSON со стандартным отступом
+    // в файлы из списка, поэтому эти параметры с --batch — ошибка, а не молчаливый пропуск
+    static const set<string> singleConversionOptions = {
+        "--input", "--output", "--stream-array", "--stream-output", "--intern-strings", "--presize",
+        "--huge-pages", "--stats", "--memory-report", "--perf-counters", "--spill", "--mmap-output",
+        "--parallel-output", "--format", "--hash", "--indent", "--hash-file" };
+    string singleConversionOption;
     for (int i = 1; i < argc; i++) {
-        if (string(argv[i]) == "--input") {
+        string arg = argv[i];
+        if (singleConversionOptions.count(arg) && singleConversionOption.empty()) singleConversionOption = arg;
+        if (arg == "--input" && i + 1 < argc) {
             inputFile = argv[++i];
         }
-        else if (string(argv[i]) == "--output") {
-            outputFile = argv[++i];
+        else if (arg == "--output" && i + 1 < argc) {
+            string value = argv[++i];
+            size_t colon = value.find(':');
+            string prefix = value.substr(0, colon);
+            if (colon != string::npos &&
+                (prefix == "json" || prefix == "msgpack" || prefix == "cbor" || prefix == "canonical")) {
+                outputs.push_back({ prefix, value.substr(colon + 1) });
+            }
+            else {
+                outputs.push_back({ "", value });
+            }
+        }
+        else if (arg == "--stream-array" && i + 1 < argc) {
+            streamedArrays.push_back(argv[++i]);
+        }
+        else if (arg == "--stream-output") {
+            streamOutput = true;
+        }
+        else if (arg == "--intern-strings") {
+            internStrings = true;
+        }
+        else if (arg == "--presize") {
+            presize = true;
+        }
+        else if (arg == "--cpu-info") {
+            cpuInfo = true;
+        }
+        else if (arg == "--huge-pages") {
+            hugePages = true;
+        }
+        else if (arg == "--stats") {
+            stats = true;
+        }
+        else if (arg == "--memory-report") {
+            memoryReport = true;
+        }
+        else if (arg == "--perf-counters") {
+            perfCounters = true;
+        }
+        else if (arg == "--batch" && i + 1 < argc) {
+            batchFile = argv[++i];
+        }
+        else if ((arg == "--job-timeout" || arg == "--time-limit" || arg == "--max-depth" ||
+            arg == "--max-nodes" || arg == "--max-output") && i + 1 < argc) {
+            // без проверки "abc" стало бы нулём, то есть снятием ограничения
+            unsigned long long value = 0;
+            if (!parseNumber(argv[++i], value)) {
+                cerr << arg << " принимает неотрицательное целое число: " << argv[i] << "\n";
+                return 1;
+            }
+            // сроки больше ~30 лет не нужны, а в наносекундах steady_clock они бы переполнились
+            unsigned long long milliseconds = min<unsigned long long>(value, 1000000000000ULL);
+            if (arg == "--job-timeout") jobTimeout = static_cast<long>(min<unsigned long long>(milliseconds, LONG_MAX));
+            else if (arg == "--time-limit") timeLimit = static_cast<long>(min<unsigned long long>(milliseconds, LONG_MAX));
+            else if (arg == "--max-depth") limits.depth = static_cast<size_t>(min<unsigned long long>(value, SIZE_MAX));
+            else if (arg == "--max-nodes") limits.nodes = static_cast<size_t>(min<unsigned long long>(value, SIZE_MAX));
+            else limits.outputBytes = value;
+        }
+        else if (arg == "--spill" && i + 1 < argc) {
+            spillDirectory = argv[++i];
+        }
+        else if (arg == "--kernels" && i + 1 < argc) {
+            string level = argv[++i];
+            if (!selectKernels(level)) {
+                cerr << "Уровень ядер " << level << " не поддерживается этим процессором (scalar, sse4.2, avx2, avx512)\n";
+                return 1;
+            }
+        }
+        else if (arg == "--mmap-output") {
+            mappedOutput = true;
+        }
+        else if (arg == "--parallel-output") {
+            parallelOutput = true;
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            unsigned long long value = 0;
+            if (!parseNumber(argv[++i], value) || value == 0) {
+                cerr << "--threads принимает целое число больше 0: " << argv[i] << "\n";
+                return 1;
+            }
+            // больше потоков, чем несколько на ядро, не ускоряет ни пакет, ни параллельный вывод,
+            // а лишь расходует стеки
+            threads = static_cast<unsigned>(min<unsigned long long>(value, maxThreads));
+        }
+        else if (arg == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        }
+        else if (arg == "--hash") {
+            hashOutputs = true;
+        }
+        else if (arg == "--indent" && i + 1 < argc) {
+            indentOption = argv[++i];
+        }
+        else if (arg == "--hash-file" && i + 1 < argc) {
+            hashOutputs = true;
+            hashFile = argv[++i];
+        }
+        else {
+            inputFile.clear();
+            batchFile.clear();
+            break;
         }
     }
 
-    if (inputFile.empty() || outputFile.empty()) {
+    bool missingPath = outputs.empty();
+    for (const auto& target : outputs) {
+        if (target.path.empty()) missingPath = true;
+    }
+    if (cpuInfo) {
+        printKernelReport(cout);
+        return 0;
+    }
+    if (!batchFile.empty() && !singleConversionOption.empty()) {
+        cerr << "--batch несовместим с " << singleConversionOption
+            << ": задания пишут JSON со стандартным отступом в файлы из списка\n";
+        return 1;
+    }
+    if (!batchFile.empty()) {
+        // строка списка: входной и выходной файл через табуляцию или пробел; # — комментарий
+        ifstream list(batchFile);
+        if (!list) {
+            cerr << "Не удается открыть список заданий: " << batchFile << "\n";
+            return 1;
+        }
+        vector<pair<string, string>> paths;
+        string line;
+        while (getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            size_t split = line.find('\t');
+            if (split == string::npos) split = line.find(' ');
+            size_t next = split == string::npos ? string::npos : line.find_first_not_of(" \t", split);
+            if (next == string::npos) {
+                cerr << "В строке списка заданий нет выходного файла: " << line << "\n";
+                return 1;
+            }
+            paths.emplace_back(line.substr(0, split), line.substr(next));
+        }
+        BatchScheduler batch(threads, 16 * 1024 * 1024, chrono::milliseconds(jobTimeout));
+        batch.limit(limits, chrono::milliseconds(timeLimit));
+        batch.submit(paths);
+        try {
+            batch.finish();
+        }
+        catch (const exception& e) {
+            cerr << "Ошибка: " << e.what() << endl;
+            return 1;
+        }
+        bool failures = false;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const BatchScheduler::Job& job = batch.job(i);
+            if (job.status == BatchScheduler::Status::done) continue;
+            cerr << "Ошибка: " << job.input << ": " << job.error << endl;
+            failures = true;
+        }
+        printBatchSummary(cout, batch);
+        return failures ? 1 : 0;
+    }
+    if (inputFile.empty() || missingPath) {
+        cerr << "Usage: " << argv[0] << " --input <input_file> --output [формат:]<output_file> ...\n";
+        cerr << "Or: " << argv[0] << " --test\n";
+        cerr << "Or: " << argv[0] << " --fuzz <число конфигураций> [seed]\n";
+        cerr << "Or: " << argv[0] << " --batch <список заданий> [--threads <N>] [--job-timeout <мс>]\n";
+        cerr << "Ограничения: --time-limit <мс>, --max-depth <N>, --max-nodes <N>, --max-output <байт>\n";
+        cerr << "Параметры: --stream-array <путь> (можно несколько раз), --stream-output,\n";
+        cerr << "           --mmap-output, --parallel-output, --threads <N>,\n";
+        cerr << "           --format json|msgpack|cbor|canonical (формат выходов без префикса),\n";
+        cerr << "           --hash, --hash-file <файл>, --indent <N>|tab, --intern-strings, --presize,\n";
+        cerr << "           --kernels scalar|sse4.2|avx2|avx512, --cpu-info, --stats, --memory-report,\n";
+        cerr << "           --huge-pages (дерево, буферы входа и вывода; без арены с --stream-output и --spill),\n";
+        cerr << "           --spill <каталог> (выгрузка больших поддеревьев во временный файл), --perf-counters\n";
+        cerr << "Вместо имени файла можно указать \"-\" для stdin/stdout\n";
         cerr << "Должны быть указаны как входные, так и выходные файлы\n";
         return 1;
     }
 
+    size_t stdoutTargets = 0;
+    bool anyMsgPack = false;
+    bool anyCanonical = false;
+    for (auto& target : outputs) {
+        if (target.format.empty()) target.format = format;
+        if (target.path == "-") stdoutTargets++;
+        if (target.format == "msgpack") anyMsgPack = true;
+        if (target.format == "canonical") anyCanonical = true;
+    }
+    if (stdoutTargets > 1) {
+        cerr << "stdout можно указать только для одного выхода\n";
+        return 1;
+    }
+    string outputFile = outputs[0].path;
+    bool toStdout = stdoutTargets > 0;
+    if ((mappedOutput || parallelOutput) && (outputs.size() > 1 || outputs[0].format != "json")) {
+        cerr << "--mmap-output и --parallel-output поддерживают только один выход в формате json\n";
+        return 1;
+    }
+    if (mappedOutput && (toStdout || streamOutput)) {
+        cerr << "--mmap-output требует выходной файл и несовместим с --stream-output\n";
+        return 1;
+    }
+    if (parallelOutput && (mappedOutput || streamOutput)) {
+        cerr << "--parallel-output несовместим с --mmap-output и --stream-output\n";
+        return 1;
+    }
+    if (anyMsgPack && streamOutput) {
+        cerr << "MessagePack требует заранее известный размер объекта и несовместим с --stream-output\n";
+        return 1;
+    }
+    if (anyCanonical && streamOutput) {
+        cerr << "Канонический JSON требует сортировки ключей и несовместим с --stream-output\n";
+        return 1;
+    }
+    unsigned long long indentWidth = 2;
+    if (indentOption != "tab" && (!parseNumber(indentOption, indentWidth) || indentWidth > 1024)) {
+        cerr << "--indent принимает число пробелов от 0 до 1024 или tab: " << indentOption << "\n";
+        return 1;
+    }
+    IndentTable indentation = indentOption == "tab" ? IndentTable(1, '\t') : IndentTable(static_cast<int>(indentWidth));
+    if ((indentOption == "tab" || indentWidth != 2) && (mappedOutput || parallelOutput)) {
+        cerr << "--mmap-output и --parallel-output используют стандартный отступ в 2 пробела\n";
+        return 1;
+    }
+    if (hashOutputs && (mappedOutput || parallelOutput)) {
+        cerr << "--hash не поддерживается с --mmap-output и --parallel-output\n";
+        return 1;
+    }
+
     try {
-        ifstream inFile(inputFile);
-        if (!inFile) {
-            throw runtime_error("Не удается открыть входной файл: " + inputFile);
+        // Текст входа должен жить до конца вывода: строки дерева ссылаются на него, а потоковые
+        // массивы перечитываются из него. Без таких массивов stdin разбирается по мере поступления блоков
+        PhaseTimer timer;
+        // срок всего преобразования; лексер и вывод проверяют его по ходу работы
+        CancellationToken deadline;
+        if (timeLimit > 0) deadline.expireAt(chrono::steady_clock::now() + chrono::milliseconds(timeLimit));
+        const CancellationToken* cancellation = timeLimit > 0 ? &deadline : nullptr;
+        unique_ptr<PerfCounters> perf;
+        if (perfCounters) {
+            perf.reset(new PerfCounters());
+            timer.countWith(*perf);
+        }
+        PageBuffer inputText(hugePages);
+        unique_ptr<InputFile> mappedInput;
+        StringPool stringPool;
+        InputShape shape;
+        // выгруженные поддеревья читаются из файла при выводе, поэтому он живёт дольше дерева
+        unique_ptr<SpillFile> spillFile;
+        if (!spillDirectory.empty()) spillFile.reset(new SpillFile(spillDirectory));
+        // с --huge-pages узлы дерева лежат в арене на больших страницах; при выводе по мере
+        // разбора и при выгрузке арена не используется, иначе память освобождённых узлов не возвращалась бы.
+        // С --stream-array арена остаётся: элементы потоковых массивов парсер создаёт вне её (см. Parser::nodeArena)
+        NodeArena arena(hugePageSize, true);
+        ParseState parseState;
+        if (hugePages && !streamOutput && !spillFile) parseState.arena = &arena;
+        unique_ptr<DescriptorSource> stdinSource;
+        unique_ptr<Lexer> lexer;
+        // предварительному проходу и отдельному проходу лексера нужен весь текст,
+        // поэтому с --presize и --perf-counters stdin читается целиком
+        if (inputFile == "-" && streamedArrays.empty() && !presize && !perfCounters) {
+            stdinSource.reset(new DescriptorSource(0));
+            lexer.reset(new Lexer(*stdinSource));
+        }
+        else {
+            if (inputFile == "-") {
+                DescriptorSource source(0);
+                char chunk[64 * 1024];
+                while (size_t n = source.read(chunk, sizeof(chunk))) {
+                    inputText.append(chunk, n);
+                    if (cancellation) cancellation->check();
+                }
+                lexer.reset(new Lexer(inputText.data(), inputText.size()));
+            }
+            else {
+                mappedInput.reset(new InputFile(inputFile));
+                lexer.reset(new Lexer(mappedInput->data(), mappedInput->size()));
+            }
         }
 
-        stringstream buffer;
-        buffer << inFile.rdbuf();
-        string inputText = buffer.str();
-        inFile.close();
+        lexer->cancelWith(cancellation);
+        Parser parser(*lexer, parseState);
+        parser.limit(limits);
+        for (const auto& path : streamedArrays) {
+            parser.streamArrayAt(path);
+        }
+        if (internStrings) {
+            parser.internStrings(stringPool);
+        }
+        if (spillFile) {
+            parser.spillTo(*spillFile);
+        }
+        if (presize) {
+            shape = countShape(lexer->text(), lexer->size());
+            parser.presize(shape);
+        }
+        timer.mark("чтение входа");
+        size_t tokens = 0;
+        if (perf) {
+            // лексер проходит вход отдельно, чтобы его счётчики не смешивались со счётчиками разбора
+            Lexer scan(lexer->text(), lexer->size());
+            for (Token token = scan.nextToken(); token.type != TokenType::EOF_TOKEN &&
+                token.type != TokenType::INVALID; token = scan.nextToken()) {
+                tokens++;
+            }
+            timer.mark("лексер");
+        }
 
-        Lexer lexer(inputText);
-        Parser parser(lexer);
-        auto ast = parser.parse();
+        // Для --memory-report дерево и константы учитываются вместе, пока дерево в памяти:
+        // узел-константа, на который ссылается и дерево, попадает в отчёт один раз
+        MemoryReport memory;
+        auto accountParse = [&](const ASTNode* root) {
+            if (!memoryReport) return;
+            if (root) root->account(memory);
+            accountConstants(memory, parseState.constants);
+        };
+        auto report = [&]() {
+            if (stats) printStats(cerr, timer, hugePages, spillFile.get());
+            if (perf) printPerfCounters(cerr, *perf, lexer->size(), tokens);
+            if (!memoryReport) return;
+            stringPool.account(memory);
+            parseState.symbols->account(memory);
+            if (mappedInput) memory.add("входной текст (отображение файла)", mappedInput->size());
+            else if (!inputText.empty()) memory.add("входной текст", inputText.size());
+            printMemoryReport(cerr, memory, parseState.arena);
+        };
 
-        ofstream outFile(outputFile);
-        if (!outFile) {
-            throw runtime_error("Не удается открыть выходной файл: " + outputFile);
+        if (mappedOutput) {
+            FrozenTree tree(parser.parse());
+            timer.mark("разбор");
+            limits.checkOutput(tree.root().jsonSize().at(0));
+            if (cancellation) cancellation->check();
+            writeMappedJSON(tree.root(), outputFile, threads);
+            timer.mark("вывод");
+            cout << "Успешно преобразованный " << inputFile << " к " << outputFile << endl;
+            accountParse(&tree.root());
+            memory.add("буфер вывода (отображение файла)", tree.root().jsonSize().at(0));
+            report();
+            return 0;
         }
 
-        outFile << ast->toJSON();
-        outFile.close();
-        cout << "Успешно преобразованный " << inputFile << " к " << outputFile << endl;
+        if (parallelOutput) {
+            FrozenTree tree(parser.parse());
+            timer.mark("разбор");
+            limits.checkOutput(tree.root().jsonSize().at(0));
+            if (cancellation) cancellation->check();
+            ParallelJsonWriter writer(threads);
+            const vector<string>& pieces = writer.serialize(tree.root());
+            PerfCounters::Mark writing;
+            if (perf) writing = perf->start();
+            if (toStdout) {
+                cout.flush();
+                writeGathered(1, pieces);
+                cerr << "Успешно преобразованный " << inputFile << " к stdout" << endl;
+            }
+            else {
+                int fd = openOutputDescriptor(outputFile);
+                try {
+                    writeGathered(fd, pieces);
+                }
+                catch (...) {
+                    closeDescriptor(fd);
+                    throw;
+                }
+                closeDescriptor(fd);
+                cout << "Успешно преобразованный " << inputFile << " к " << outputFile << endl;
+            }
+            if (perf) perf->finish("запись", writing);
+            timer.mark("вывод");
+            accountParse(&tree.root());
+            size_t pieceBytes = 0;
+            for (const auto& piece : pieces) pieceBytes += sizeof(piece) + MemoryReport::heapBytes(piece);
+            memory.add("буфер вывода (куски)", pieceBytes, pieces.size());
+            report();
+            return 0;
+        }
+
+        string written;
+        string hashes;
+        {
+            // все выходы получают события одного обхода дерева
+            vector<unique_ptr<OutputFile>> files;
+            vector<unique_ptr<OutputSink>> sinks;
+            vector<unique_ptr<Emitter>> emitters;
+            vector<unique_ptr<Sha256>> digests;
+            TeeEmitter tee;
+            for (const auto& target : outputs) {
+                // буфер вывода копится блоками и уходит в дескриптор через writev, минуя ostream
+                int fd = 1;
+                if (target.path == "-") {
+                    cout.flush();
+#ifdef _WIN32
+                    if (target.format != "json") _setmode(_fileno(stdout), _O_BINARY);
+#endif
+                }
+                else {
+                    files.emplace_back(new OutputFile(target.path));
+                    fd = files.back()->descriptor();
+                }
+                sinks.emplace_back(new OutputSink(fd, 64 * 1024, hugePages));
+                if (hashOutputs) {
+                    digests.emplace_back(new Sha256());
+                    sinks.back()->hashWith(*digests.back());
+                }
+                // с --stream-output буфер сбрасывает поток записи EntryWriter, а счётчики открыты
+                // только для основного потока: этап «запись» не выделяется и остаётся внутри разбора
+                if (perf && !streamOutput) sinks.back()->countWritesWith(*perf);
+                sinks.back()->limit(limits, cancellation);
+                emitters.push_back(makeEmitter(target.format, *sinks.back(), indentation));
+                tee.add(*emitters.back());
+                if (!written.empty()) written += ", ";
+                written += target.path == "-" ? "stdout" : target.path;
+            }
+            Emitter& emitter = emitters.size() == 1 ? *emitters[0] : tee;
+
+            if (streamOutput) {
+                // каждая запись верхнего уровня выводится сразу после разбора
+                EntryWriter writer(emitter);
+                parser.parseEntries([&writer](const Symbol& key, NodeRef<ASTNode> value) {
+                    writer.add(key, value);
+                });
+                writer.finish();
+                timer.mark("разбор и вывод");
+                accountParse(nullptr);
+            }
+            else {
+                auto ast = parser.parse();
+                timer.mark("разбор");
+                ast->emit(emitter);
+                emitter.flush();
+                timer.mark("вывод");
+                accountParse(ast.get());
+            }
+            for (const auto& sink : sinks) memory.add("буфер вывода", sink->bufferBytes());
+            for (size_t i = 0; i < digests.size(); ++i) {
+                hashes += digests[i]->hexDigest() + "  " + outputs[i].path + "\n";
+            }
+        }
+
+        (toStdout ? cerr : cout) << "Успешно преобразованный " << inputFile << " к " << written << endl;
+        if (hashOutputs) {
+            // формат строк как у sha256sum
+            (toStdout ? cerr : cout) << "SHA-256:\n" << hashes;
+            if (!hashFile.empty()) {
+                ofstream hashOut(hashFile);
+                if (!hashOut) {
+                    throw runtime_error("Не удается открыть файл для хешей: " + hashFile);
+                }
+                hashOut << hashes;
+            }
+        }
+        report();
 
     }
     catch (const exception& e) {
@@ -511,4 +6187,4 @@ int main(int argc, char* argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}